@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# scaling-bench.sh - end-to-end scaling benchmark for sidus
+#
+# Usage: scaling-bench.sh <sidus> <sidusgen> <results.csv>
+#
+# Generates catalogs of increasing size with sidusgen, converts each with
+# a set of option combinations and thread counts, and appends one line
+# per run to the CSV file, creating it with a header line if missing.
+# Timing and memory come from sidus --profile=json.
+#
+# Environment:
+#  SIDUS_BENCH_SIZES	star counts (default "10000 100000 1000000")
+#  SIDUS_BENCH_THREADS	thread counts (default "1 2 4 <ncpu>")
+#  SIDUS_BENCH_RUNS	runs per combination, the fastest is kept (default 3)
+#  SIDUS_BENCH_DIR	where to keep generated catalogs (default a temp dir)
+
+set -eu
+
+if [ $# -ne 3 ]; then
+	echo "Usage: $0 <sidus> <sidusgen> <results.csv>" >&2
+	exit 1
+fi
+
+sidus=$1
+sidusgen=$2
+results=$3
+
+ncpu=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+sizes=${SIDUS_BENCH_SIZES:-"10000 100000 1000000"}
+threads=${SIDUS_BENCH_THREADS:-"$(echo 1 2 4 "$ncpu" | tr ' ' '\n' | sort -n -u | tr '\n' ' ')"}
+runs=${SIDUS_BENCH_RUNS:-3}
+
+if [ -n "${SIDUS_BENCH_DIR:-}" ]; then
+	dir=$SIDUS_BENCH_DIR
+	mkdir -p "$dir"
+else
+	dir=$(mktemp -d)
+	trap 'rm -rf "$dir"' EXIT
+fi
+
+revision=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo unknown)
+timestamp=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+if [ ! -s "$results" ]; then
+	echo "timestamp,revision,stars,options,threads,wall_seconds,stars_per_second,mb_per_second,peak_rss_kb" > "$results"
+fi
+
+# Extracts a top level number from the --profile=json output.
+field() {
+	sed -n "s/.*\"$1\":\([0-9.e+-]*\).*/\1/p"
+}
+
+for size in $sizes; do
+	catalog=$dir/catalog-$size.bin
+	if [ ! -f "$catalog" ]; then
+		"$sidusgen" -n"$size" -N12 -k2 -s1 "$catalog"
+	fi
+	bytes=$(wc -c < "$catalog")
+
+	for options in "" "-c" "-s" "-m" "-r" "-n" "-p" "-f6" "-c -s -m -n -p"; do
+		for t in $threads; do
+			best=
+			best_rss=
+			run=0
+			while [ $run -lt "$runs" ]; do
+				# shellcheck disable=SC2086
+				profile=$("$sidus" --profile=json --threads "$t" $options "$catalog" 2>&1 >/dev/null | tail -n 1)
+				wall=$(echo "$profile" | field wall_seconds)
+				rss=$(echo "$profile" | field peak_rss_kb)
+				if [ -z "$best" ] || awk "BEGIN { exit !($wall < $best) }"; then
+					best=$wall
+					best_rss=$rss
+				fi
+				run=$((run + 1))
+			done
+			rate=$(awk "BEGIN { print $size / $best }")
+			mbs=$(awk "BEGIN { print $bytes / $best / 1000000 }")
+			printf '%s,%s,%s,"%s",%s,%s,%.0f,%.1f,%s\n' \
+			    "$timestamp" "$revision" "$size" "$options" "$t" \
+			    "$best" "$rate" "$mbs" "$best_rss" >> "$results"
+			printf '%10s stars  %-16s %3s threads  %10.6f s  %12.0f stars/s  %8s kB\n' \
+			    "$size" "$options" "$t" "$best" "$rate" "$best_rss"
+		done
+	done
+done
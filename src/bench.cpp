@@ -0,0 +1,368 @@
+/**
+ * sidus-bench - microbenchmarks for the sidus converter
+ *
+ * Copyright (c) 2019 Jon Olsson <jlo@wintermute.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define SIDUS_NO_MAIN
+#include "sidus.cpp"
+
+namespace {
+
+/*
+ * Every benchmark is run a few times over the same generated data and
+ * the median time per item is reported, along with the spread between
+ * the fastest and slowest run, so regressions stand out from noise.
+ */
+static int const NUM_RUNS = 9;
+static int const NUM_ITEMS = 1 << 16;
+
+static volatile double sink;
+static Arena names;	// for the names of generated stars
+
+class Random {
+public:
+	explicit Random(std::uint64_t const seed)
+	    : state(seed ? seed : 1)
+	{
+	}
+
+	std::uint64_t
+	next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	double
+	uniform(double const min, double const max)
+	{
+		return min + (max - min)*(next() >> 11)*(1.0/9007199254740992.0);
+	}
+
+private:
+	std::uint64_t state;
+};
+
+static
+void
+put(unsigned char* data, std::uint64_t const value, int const size, bool const littleEndian)
+{
+	for (auto i = 0; i < size; ++i) {
+		auto const byte = (unsigned char)(value >> (8*i));
+		data[littleEndian ? i : size - 1 - i] = byte;
+	}
+}
+
+static
+void
+put(unsigned char* data, float const value, bool const littleEndian)
+{
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	put(data, bits, 4, littleEndian);
+}
+
+static
+void
+put(unsigned char* data, double const value, bool const littleEndian)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	put(data, bits, 8, littleEndian);
+}
+
+static
+Header
+makeHeader(
+    Header::StarId const starId,
+    Header::ProperMotion const properMotion,
+    int const numMagnitudes,
+    int const starNameLength,
+    bool const littleEndian)
+{
+	Header header;
+	header.numStars = NUM_ITEMS;
+	header.starId = starId;
+	header.starNameLength = starNameLength;
+	header.properMotion = properMotion;
+	header.numMagnitudes = numMagnitudes;
+	header.apparentMagnitude = numMagnitudes - 1;
+	header.epoch = Epoch::J2000;
+	header.littleEndian = littleEndian;
+	header.numBytesPerStar = 0;
+	header.numBytesPerStar = recordLayout(header).size;
+	return header;
+}
+
+static
+std::vector<unsigned char>
+makeRecords(Header const& header, std::uint64_t const seed)
+{
+	static char const types[] = "OBAFGKM";
+	auto const layout = recordLayout(header);
+	auto const le = header.littleEndian;
+	Random random(seed);
+	std::vector<unsigned char> data((size_t)header.numStars*header.numBytesPerStar);
+	for (auto i = 0; i < header.numStars; ++i) {
+		auto const record = &data[(size_t)i*header.numBytesPerStar];
+		if (header.starId == Header::INTEGER_STAR_ID) {
+			put(record + layout.id, (std::uint64_t)i + 1, 4, le);
+		}
+		else if (header.starId != Header::NO_STAR_ID) {
+			put(record + layout.id, (float)(i + 1), le);
+		}
+		put(record + layout.rightAscension, random.uniform(0.0, 2.0*M_PI), le);
+		put(record + layout.declination, std::asin(random.uniform(-1.0, 1.0)), le);
+		record[layout.spectralType + 0] = types[random.next()%7];
+		record[layout.spectralType + 1] = '0' + random.next()%10;
+		for (auto m = 0; m < header.numMagnitudes; ++m) {
+			put(record + layout.magnitudes + 2*m, (std::uint64_t)(random.next()%900) - 100, 2, le);
+		}
+		if (header.properMotion == Header::PROPER_MOTION) {
+			put(record + layout.properMotion, (float)random.uniform(-1e-5, 1e-5), le);
+			put(record + layout.properMotion + 4, (float)random.uniform(-1e-5, 1e-5), le);
+		}
+		else if (header.properMotion == Header::RADIAL_VELOCITY) {
+			put(record + layout.properMotion, random.uniform(-100.0, 100.0), le);
+		}
+		for (auto c = 0; c < header.starNameLength; ++c) {
+			record[layout.name + c] = 'A' + random.next()%26;
+		}
+	}
+	return data;
+}
+
+static
+std::vector<Star>
+makeStars(size_t const count, std::uint64_t const seed)
+{
+	auto const header = makeHeader(Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 1, 8, true);
+	auto const data = makeRecords(header, seed);
+	std::vector<Star> stars(count);
+	for (size_t i = 0; i < count; ++i) {
+		parseStar(&stars[i], header, &data[(i%NUM_ITEMS)*header.numBytesPerStar], &names);
+	}
+	return stars;
+}
+
+static char const* benchFilter = nullptr;
+
+/*
+ * Runs fn, which handles items things per call, and reports on it.
+ * Returns the number of allocations per item in the timed runs.
+ */
+template <typename Fn>
+static
+double
+bench(char const* const name, size_t const items, Fn fn)
+{
+	if (benchFilter && !std::strstr(name, benchFilter)) {
+		return 0.0;
+	}
+	fn();	// warm up
+	std::vector<double> times;
+	times.reserve(NUM_RUNS);
+	auto const allocations = numAllocations.load();
+	for (auto run = 0; run < NUM_RUNS; ++run) {
+		auto const start = std::chrono::steady_clock::now();
+		fn();
+		auto const elapsed = std::chrono::steady_clock::now() - start;
+		times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()/(double)items);
+	}
+	auto const perItem = (numAllocations - allocations)/((double)NUM_RUNS*items);
+	std::sort(times.begin(), times.end());
+	auto const median = times[NUM_RUNS/2];
+	std::fprintf(stdout, "%-40s %10.2f ns/item %12.0f items/s %7.1f%% spread %8.4f allocs/item\n",
+		     name, median, 1e9/median,
+		     100.0*(times.back() - times.front())/median, perItem);
+	return perItem;
+}
+
+template <typename T>
+static
+void
+benchParse(char const* const name, bool const littleEndian)
+{
+	Random random(1);
+	std::vector<unsigned char> data(NUM_ITEMS*sizeof(T));
+	for (auto& byte : data) {
+		byte = (unsigned char)random.next();
+	}
+	bench(name, NUM_ITEMS, [&] {
+		double sum = 0.0;
+		for (auto i = 0; i < NUM_ITEMS; ++i) {
+			T value;
+			parse(&value, &data[i*sizeof(T)], littleEndian);
+			sum += (double)value;
+		}
+		sink = sum;
+	});
+}
+
+static
+void
+benchParseStar(
+    char const* const name,
+    Header::StarId const starId,
+    Header::ProperMotion const properMotion,
+    int const numMagnitudes,
+    int const starNameLength,
+    bool const littleEndian)
+{
+	auto const header = makeHeader(starId, properMotion, numMagnitudes, starNameLength, littleEndian);
+	auto const data = makeRecords(header, 2);
+	bench(name, NUM_ITEMS, [&] {
+		Arena names;
+		double sum = 0.0;
+		for (auto i = 0; i < NUM_ITEMS; ++i) {
+			Star star;
+			parseStar(&star, header, &data[(size_t)i*header.numBytesPerStar], &names);
+			sum += star.magnitude;
+		}
+		sink = sum;
+	});
+}
+
+/*
+ * decode with warm scratch, as a worker sees every chunk but its first.
+ * That must not allocate at all, names included.
+ */
+static
+double
+benchDecode(char const* const name, int const starNameLength, char const* const filterText)
+{
+	auto header = makeHeader(Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 3, starNameLength, true);
+	header.numStars = CHUNK_STARS;
+	Chunk chunk;
+	chunk.seq = 0;
+	chunk.first = 0;
+	chunk.count = CHUNK_STARS;
+	chunk.data = makeRecords(header, 5);
+	Options options;
+	options.spectralFilter = false;
+	if (compileFilter(&options.filter, filterText, DBL_MAX) != 0) {
+		return 0.0;
+	}
+	// The names arena grows in blocks on the first chunk and merges them
+	// into one on the next, so warm up once more than bench() does.
+	DecodeScratch scratch;
+	Batch batch;
+	decode(&batch, &scratch, chunk, header, options);
+	return bench(name, CHUNK_STARS, [&] {
+		decode(&batch, &scratch, chunk, header, options);
+		sink = batch.stars.size();
+	});
+}
+
+static
+void
+benchSort(char const* const name, size_t const count, int const numThreads, bool const multimap)
+{
+	pool.start(numThreads);
+	auto const stars = makeStars(count, 3);
+	std::vector<SortKey> keys(1, SortKey{ SortField::MAG, false });
+	if (multimap) {
+		bench(name, count, [&] {
+			std::multimap<double, Star const*> map;
+			for (auto const& star : stars) {
+				map.insert(std::make_pair(star.magnitude, &star));
+			}
+			sink = map.begin()->first;
+		});
+	} else {
+		bench(name, count, [&] {
+			std::vector<std::uint32_t> order;
+			sortStars(&order, stars, keys, numThreads);
+			sink = order[0];
+		});
+	}
+}
+
+static
+void
+benchPrint(char const* const name, bool const cformat, bool const usefloat)
+{
+	auto const stars = makeStars(NUM_ITEMS, 4);
+	auto const header = makeHeader(Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 1, 8, true);
+	Format format = Format();
+	format.cformat = cformat;
+	format.usefloat = usefloat;
+	format.usename = true;
+	format.usetype = true;
+	std::string text;
+	bench(name, NUM_ITEMS, [&] {
+		text.clear();
+		auto idx = 0;
+		for (auto const& star : stars) {
+			print(&text, star, header, idx++, format);
+		}
+		sink = text.size();
+	});
+}
+
+}	// !namespace
+
+int
+main(int argc, char** argv)
+{
+	if (argc > 2) {
+		std::fprintf(stderr, "Usage: sidus-bench [name-filter]\n");
+		return -1;
+	}
+	if (argc == 2) {
+		benchFilter = argv[1];
+	}
+
+	benchParse<std::int16_t>("parse int16 le", true);
+	benchParse<std::int16_t>("parse int16 be", false);
+	benchParse<std::int32_t>("parse int32 le", true);
+	benchParse<std::int32_t>("parse int32 be", false);
+	benchParse<float>("parse float le", true);
+	benchParse<float>("parse float be", false);
+	benchParse<double>("parse double le", true);
+	benchParse<double>("parse double be", false);
+
+	benchParseStar("parseStar bsc5 le", Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 1, 0, true);
+	benchParseStar("parseStar bsc5 be", Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 1, 0, false);
+	benchParseStar("parseStar no id, no motion", Header::NO_STAR_ID, Header::NO_PROPER_MOTION, 1, 0, true);
+	benchParseStar("parseStar integer id, velocity", Header::INTEGER_STAR_ID, Header::RADIAL_VELOCITY, 1, 0, true);
+	benchParseStar("parseStar 5 magnitudes", Header::CATALOG_STAR_ID, Header::PROPER_MOTION, 5, 0, true);
+	benchParseStar("parseStar names", Header::NO_STAR_ID, Header::PROPER_MOTION, 1, 12, true);
+
+	auto decodeAllocations = 0.0;
+	decodeAllocations += benchDecode("decode chunk", 0, "");
+	decodeAllocations += benchDecode("decode chunk, filter", 0, "mag < 5 && spectral ~ \"B*\"");
+	decodeAllocations += benchDecode("decode chunk, names", 16, "");
+
+	benchSort("sort multimap 64k", NUM_ITEMS, 1, true);
+	benchSort("sort vector 64k", NUM_ITEMS, 1, false);
+	benchSort("sort multimap 1M", 1 << 20, 1, true);
+	benchSort("sort vector 1M", 1 << 20, 1, false);
+	benchSort("sort vector 1M, 4 threads", 1 << 20, 4, false);
+
+	benchPrint("print csv double", false, false);
+	benchPrint("print csv float", false, true);
+	benchPrint("print c double", true, false);
+	benchPrint("print c float", true, true);
+
+	if (decodeAllocations != 0.0) {
+		std::fprintf(stderr, "sidus-bench: decode allocates per star\n");
+		return -1;
+	}
+	return 0;
+}
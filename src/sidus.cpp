@@ -20,16 +20,48 @@
 
 #if defined(__unix__)
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sched.h>
 #endif
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <algorithm>
 #include <fstream>
 #include <cctype>
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
 #include <cfloat>
 #include <cassert>
+#include <cmath>
 
 namespace {
 
@@ -58,18 +90,138 @@ struct Header {
 	bool littleEndian;
 };
 
+static int const MAX_MAGNITUDES = 10;
+
+static size_t const ARENA_BLOCK_SIZE = 64 << 10;
+
+/*
+ * A bump allocator for data that lives as long as a batch of stars, such
+ * as their names: allocation is a pointer increment and everything is
+ * released at once when the arena goes away, or reused after clear().
+ */
+class Arena {
+public:
+	Arena()
+	    : blocks(nullptr), cursor(nullptr), end(nullptr)
+	{
+	}
+
+	~Arena()
+	{
+		release(blocks);
+	}
+
+	Arena(Arena&& other) noexcept
+	    : blocks(other.blocks), cursor(other.cursor), end(other.end)
+	{
+		other.blocks = nullptr;
+		other.cursor = nullptr;
+		other.end = nullptr;
+	}
+
+	Arena&
+	operator=(Arena&& other) noexcept
+	{
+		if (this != &other) {
+			release(blocks);
+			blocks = other.blocks;
+			cursor = other.cursor;
+			end = other.end;
+			other.blocks = nullptr;
+			other.cursor = nullptr;
+			other.end = nullptr;
+		}
+		return *this;
+	}
+
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+
+	// Keeps the memory for reuse, in one block once it took several.
+	void
+	clear()
+	{
+		if (blocks && blocks->next) {
+			size_t capacity = 0;
+			for (auto block = blocks; block; block = block->next) {
+				capacity += block->capacity;
+			}
+			release(blocks);
+			blocks = (Block*)::operator new(sizeof(Block) + capacity);
+			blocks->next = nullptr;
+			blocks->capacity = capacity;
+		}
+		if (blocks) {
+			cursor = (char*)(blocks + 1);
+			end = cursor + blocks->capacity;
+		}
+	}
+
+	void*
+	allocate(size_t const size, size_t const align = alignof(double))
+	{
+		auto p = (char*)(((std::uintptr_t)cursor + align - 1) & ~(std::uintptr_t)(align - 1));
+		if (!cursor || size > (size_t)(end - p)) {
+			auto const capacity = std::max(ARENA_BLOCK_SIZE, size + align);
+			auto const block = (Block*)::operator new(sizeof(Block) + capacity);
+			block->next = blocks;
+			block->capacity = capacity;
+			blocks = block;
+			cursor = (char*)(block + 1);
+			end = cursor + capacity;
+			p = (char*)(((std::uintptr_t)cursor + align - 1) & ~(std::uintptr_t)(align - 1));
+		}
+		cursor = p + size;
+		return p;
+	}
+
+	// Copies at most length characters of s, like strncpy, and terminates.
+	char const*
+	copy(char const* const s, int const length)
+	{
+		auto const p = (char*)allocate(length + 1, 1);
+		std::strncpy(p, s, length);
+		p[length] = '\0';
+		return p;
+	}
+
+private:
+	struct Block {
+		Block* next;
+		size_t capacity;
+	};
+
+	static
+	void
+	release(Block* block)
+	{
+		while (block) {
+			auto const next = block->next;
+			::operator delete(block);
+			block = next;
+		}
+	}
+
+	Block* blocks;
+	char* cursor;
+	char* end;
+};
+
 struct Star {
-	std::string name;
+	char const* name;	// in an Arena, or "" when there are none
 	double rightAscension;	// J2000 or B1950, radians
 	double declination;	// J2000 or B1950, radians
 	double starId;
-	float magnitude;
+	float magnitude;	// the apparent magnitude in use
+	float magnitudes[MAX_MAGNITUDES];
 	struct ProperMotion {
 		float rightAscension;	// Radians per year
 		float declination;	// Radians per year
 	} properMotion;
 	double radialVelocity;		// kilometers per second
 	char spectralType[3];
+	int level;			// --lod level
+	std::uint32_t aggregated;	// --lod stars summed into this entry, or 0
 };
 
 static
@@ -77,8 +229,10 @@ void
 usage(FILE * f)
 {
 	std::fprintf(f, "Usage: sidus [option(s)] <input-file>\n");
+	std::fprintf(f, "       sidus --merge-shards [option(s)] <shard-file>...\n");
 	std::fprintf(f, "Options:\n");
 	std::fprintf(f, " -a<0-9>	specify apparent magnitude, if multiple exist\n");
+	std::fprintf(f, "		(default is the last one)\n");
 	std::fprintf(f, " -f<0-9>	filter magnitudes weaker than specified\n");
 	std::fprintf(f, " -B1950		expect B1950 epoch\n");
 	std::fprintf(f, " -J2000		expect J2000 epoch\n");
@@ -87,10 +241,55 @@ usage(FILE * f)
 	std::fprintf(f, " -be		expect big-endian format\n");
 	std::fprintf(f, " -s		output single-precision floating point\n");
 	std::fprintf(f, " -i		output only information from catalog header\n");
-	std::fprintf(f, " -m		sort output by decreasing magnitude\n");
+	std::fprintf(f, " --stats	output only statistics over all stars\n");
+	std::fprintf(f, " --watch <output>	convert into output, and again whenever the\n");
+	std::fprintf(f, "		input file is rewritten\n");
+	std::fprintf(f, " --diff <old>	report stars removed, added or changed since old\n");
+	std::fprintf(f, " --diff-by <id|index>	pair stars by id (default, if both have ids) or index\n");
+	std::fprintf(f, " --tolerance <field=value,...>	ignore smaller differences in ra, dec,\n");
+	std::fprintf(f, "		mag, pmra, pmdec or rv\n");
+	std::fprintf(f, " --serve <socket>	load the catalog once and answer queries on a\n");
+	std::fprintf(f, "		Unix domain socket, see the source for the protocol\n");
+	std::fprintf(f, " -m		sort output by increasing magnitude, brightest first\n");
 	std::fprintf(f, " -r		sort output by increasing right-ascension\n");
 	std::fprintf(f, " -n		output star names\n");
 	std::fprintf(f, " -p		output spectral class\n");
+	std::fprintf(f, " --bands <list>	also output the given magnitudes, e.g. 0,1\n");
+	std::fprintf(f, " --colors <list>	also output magnitude differences, e.g. 0-1\n");
+	std::fprintf(f, " --filter <expr>	only output stars matching the expression, e.g.\n");
+	std::fprintf(f, "		'mag < 6 && dec > -0.5 && spectral ~ \"B*\"', on the\n");
+	std::fprintf(f, "		fields mag, mag<0-9>, ra, dec, id, pmra, pmdec,\n");
+	std::fprintf(f, "		rv, spectral and name\n");
+	std::fprintf(f, " --spectral <classes>	only output stars of the given spectral\n");
+	std::fprintf(f, "		classes, e.g. OB\n");
+	std::fprintf(f, " --sort <keys>	sort output by a comma separated list of keys:\n");
+	std::fprintf(f, "		mag, ra, dec, id, spectral, healpix, cell, each\n");
+	std::fprintf(f, "		optionally followed by :asc (default) or :desc\n");
+	std::fprintf(f, " --cull		with -c, sort by sky cell and add a view culling\n");
+	std::fprintf(f, "		function to the header\n");
+	std::fprintf(f, " --lod <k>	output levels of detail: per HEALPix cell of each\n");
+	std::fprintf(f, "		level the brightest k stars left and the summed flux\n");
+	std::fprintf(f, "		of the rest, with level and count columns added\n");
+	std::fprintf(f, " --tiles <file>	write a pyramid of HEALPix tiles to file, level L\n");
+	std::fprintf(f, "		holding the stars brighter than its limit, see the\n");
+	std::fprintf(f, "		source for the format\n");
+	std::fprintf(f, " --tile-limits <list>	magnitude limit per level (default 6,8,10,12)\n");
+	std::fprintf(f, " --max-memory <size>	sort in runs of about size bytes, e.g. 512M,\n");
+	std::fprintf(f, "		spilled to temporary files and merged, so that\n");
+	std::fprintf(f, "		sorted output is not limited by memory; with --tiles\n");
+	std::fprintf(f, "		build the tiles a region of the sky at a time\n");
+	std::fprintf(f, " --shard <i/n>	convert only the i-th of n equal ranges of records,\n");
+	std::fprintf(f, "		sorted as asked, into a partial output\n");
+	std::fprintf(f, " --merge-shards	merge the partial outputs given instead of an\n");
+	std::fprintf(f, "		input file into the output of the whole conversion\n");
+	std::fprintf(f, " --threads <n>	number of threads for all work (default: one per\n");
+	std::fprintf(f, "		core), the per-thread load is in --profile\n");
+	std::fprintf(f, " --numa		pin the threads to the NUMA nodes in turn, each\n");
+	std::fprintf(f, "		reading the records it decodes\n");
+	std::fprintf(f, " --huge-pages	back large input, column and sort buffers with\n");
+	std::fprintf(f, "		huge pages, on Linux\n");
+	std::fprintf(f, " --profile[=json]	report time and throughput per phase on stderr\n");
+	std::fprintf(f, " --counters	add hardware counters to the profile, on Linux\n");
 	std::fprintf(f, " -h | --help	show this help information\n");
 	std::fprintf(f, " -v | --version	show version information\n");
 }
@@ -132,461 +331,6003 @@ getFileSize(size_t* size, const char* const path)
 
 static
 int
-readFile(void * data, char const * const path, size_t const filesize)
+readFully(FILE * f, void * data, size_t const size)
 {
 	unsigned char * buf = (unsigned char*)data;
-	FILE *f = fopen(path, "rb");
-	if (f) {
-		for (size_t i = 0u; i < filesize;) {
-			size_t rv = fread(buf + i, 1, filesize - i, f);
-			if (rv > 0) {
-				i += rv;
-			}
-			else if (ferror(f)) {
-				fclose(f);
-				return -2;
-			}
+	for (size_t i = 0u; i < size;) {
+		size_t rv = fread(buf + i, 1, size - i, f);
+		if (rv > 0) {
+			i += rv;
+		}
+		else if (ferror(f) || feof(f)) {
+			return -2;
 		}
-		fclose(f);
-		return 0;
 	}
-	return -1;
+	return 0;
 }
 
-
+// Reads size bytes at offset in f, from any thread.
 static
-void
-parse(std::int16_t* val, unsigned char const* const data, bool const littleEndian)
+int
+readAt(FILE * f, long const offset, void * data, size_t const size)
 {
-	if (littleEndian) {
-		*val =
-		    ((short)(data[0])<<0) |
-		    ((short)(data[1])<<8);
-	} else {
-		*val = 
-		    ((short)(data[0])<<8) |
-		    ((short)(data[1])<<0);
+#if defined(__unix__)
+	unsigned char * buf = (unsigned char*)data;
+	for (size_t i = 0u; i < size;) {
+		ssize_t rv = pread(fileno(f), buf + i, size - i, (off_t)(offset + i));
+		if (rv > 0) {
+			i += rv;
+		}
+		else if (rv == 0 || errno != EINTR) {
+			return -2;
+		}
+	}
+	return 0;
+#else
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (std::fseek(f, offset, SEEK_SET) != 0) {
+		return -2;
 	}
+	return readFully(f, data, size);
+#endif
 }
 
+/*
+ * --profile: time spent and data moved per phase of the conversion.
+ * Phases running on several threads at once add up their threads' time,
+ * so with overlap the phases can sum to more than the wall time.
+ */
+enum Phase {
+	PHASE_READ,
+	PHASE_HEADER,
+	PHASE_DECODE,
+	PHASE_FILTER,
+	PHASE_SORT,
+	PHASE_OUTPUT,
+	NUM_PHASES
+};
+
+static char const* const phaseNames[NUM_PHASES] = {
+	"read", "header", "decode", "filter", "sort", "output"
+};
+
+enum Counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BRANCH_MISSES,
+	NUM_COUNTERS
+};
+
+static char const* const counterNames[NUM_COUNTERS] = {
+	"cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+struct Profile {
+	bool enabled;
+	bool json;
+	bool counters;		// hardware performance counters asked for
+	std::atomic<bool> countersMissing;
+	std::chrono::steady_clock::time_point start;
+	std::atomic<std::uint64_t> nanoseconds[NUM_PHASES];
+	std::atomic<std::uint64_t> bytes[NUM_PHASES];
+	std::atomic<std::uint64_t> stars[NUM_PHASES];
+	std::atomic<std::uint64_t> events[NUM_PHASES][NUM_COUNTERS];
+};
+
+static Profile profile;
+static std::atomic<std::uint64_t> numAllocations(0);
+
+// Allocations are only counted for --profile, and by the benchmarks.
 static
 void
-parse(std::int32_t* val, unsigned char const* const data, bool const littleEndian)
+countAllocation()
 {
-	if (littleEndian) {
-		*val =
-		    ((int)(data[0])<<0) |
-		    ((int)(data[1])<<8) |
-		    ((int)(data[2])<<16) |
-		    ((int)(data[3])<<24);
-	} else {
-		*val =
-		    ((int)(data[0])<<24) |
-		    ((int)(data[1])<<16) |
-		    ((int)(data[2])<<8) |
-		    ((int)(data[3])<<0);
+#if defined(SIDUS_NO_MAIN)
+	++numAllocations;
+#else
+	if (profile.enabled) {
+		++numAllocations;
 	}
+#endif
 }
 
+/*
+ * Hardware performance counters of the calling thread, read through
+ * perf_event_open(2) on Linux.  Counters the kernel or hardware will not
+ * provide read as zero; with none at all, --counters just notes that.
+ */
+class HardwareCounters {
+public:
+	HardwareCounters()
+	    : leader(-1), numOpen(0)
+	{
+#if defined(__linux__)
+		static std::uint64_t const configs[NUM_COUNTERS] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+		for (auto i = 0; i < NUM_COUNTERS; ++i) {
+			struct perf_event_attr attr;
+			std::memset(&attr, 0, sizeof attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof attr;
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP;
+			auto const fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+			if (fd < 0) {
+				continue;
+			}
+			if (leader < 0) {
+				leader = fd;
+			}
+			fds[numOpen] = fd;
+			counters[numOpen++] = (Counter)i;
+		}
+#endif
+		if (numOpen == 0) {
+			profile.countersMissing = true;
+		}
+	}
+
+	~HardwareCounters()
+	{
+#if defined(__linux__)
+		for (auto i = 0; i < numOpen; ++i) {
+			close(fds[i]);
+		}
+#endif
+	}
+
+	HardwareCounters(HardwareCounters const&) = delete;
+	HardwareCounters& operator=(HardwareCounters const&) = delete;
+
+	void
+	read(std::uint64_t values[NUM_COUNTERS])
+	{
+		for (auto i = 0; i < NUM_COUNTERS; ++i) {
+			values[i] = 0;
+		}
+#if defined(__linux__)
+		if (numOpen == 0) {
+			return;
+		}
+		std::uint64_t group[1 + NUM_COUNTERS];
+		if (::read(leader, group, sizeof group) < (ssize_t)sizeof(std::uint64_t)) {
+			return;
+		}
+		for (auto i = 0; i < (int)group[0] && i < numOpen; ++i) {
+			values[counters[i]] = group[1 + i];
+		}
+#endif
+	}
+
+	static
+	HardwareCounters&
+	get()
+	{
+		static thread_local HardwareCounters counters;
+		return counters;
+	}
+
+private:
+	int leader;
+	int numOpen;
+	int fds[NUM_COUNTERS];
+	Counter counters[NUM_COUNTERS];
+};
+
+class PhaseTimer {
+public:
+	explicit PhaseTimer(Phase const phase, size_t const bytes = 0, size_t const stars = 0)
+	    : phase(phase)
+	{
+		if (profile.enabled) {
+			profile.bytes[phase] += bytes;
+			profile.stars[phase] += stars;
+			if (profile.counters) {
+				HardwareCounters::get().read(events);
+			}
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~PhaseTimer()
+	{
+		if (profile.enabled) {
+			auto const elapsed = std::chrono::steady_clock::now() - start;
+			profile.nanoseconds[phase] +=
+			    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+			if (profile.counters) {
+				std::uint64_t now[NUM_COUNTERS];
+				HardwareCounters::get().read(now);
+				for (auto i = 0; i < NUM_COUNTERS; ++i) {
+					profile.events[phase][i] += now[i] - events[i];
+				}
+			}
+		}
+	}
+
+	PhaseTimer(PhaseTimer const&) = delete;
+	PhaseTimer& operator=(PhaseTimer const&) = delete;
+
+private:
+	Phase const phase;
+	std::chrono::steady_clock::time_point start;
+	std::uint64_t events[NUM_COUNTERS];
+};
+
+// Reads a sysfs CPU or node list, e.g. "0-3,8-11".
 static
-void
-parse(float* val, unsigned char const* const data, bool const littleEndian)
+int
+readCpuList(std::vector<int>* list, char const* const path)
 {
-	assert(sizeof(float) == sizeof(std::uint32_t));
-	if (littleEndian) {
-		auto const v2 =
-		    ((std::uint32_t)(data[0])<<0) |
-		    ((std::uint32_t)(data[1])<<8) |
-		    ((std::uint32_t)(data[2])<<16) |
-		    ((std::uint32_t)(data[3])<<24);
-		std::memcpy(val, &v2, sizeof v2);
-	} else {
-		auto const v2 =
-		    ((std::uint32_t)(data[0])<<24) |
-		    ((std::uint32_t)(data[1])<<16) |
-		    ((std::uint32_t)(data[2])<<8) |
-		    ((std::uint32_t)(data[3])<<0);
-		std::memcpy(val, &v2, sizeof v2);
+	std::ifstream in(path);
+	std::string text;
+	if (!std::getline(in, text)) {
+		return -1;
 	}
+	auto p = text.c_str();
+	while (*p) {
+		char* end;
+		auto const first = std::strtol(p, &end, 10);
+		if (end == p) {
+			return -1;
+		}
+		auto last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = std::strtol(p, &end, 10);
+			if (end == p) {
+				return -1;
+			}
+		}
+		for (auto i = first; i <= last; ++i) {
+			list->push_back((int)i);
+		}
+		p = *end == ',' ? end + 1 : end + std::strlen(end);
+	}
+	return 0;
 }
 
+// The CPUs of each NUMA node, none where that is not known.
 static
-void
-parse(double* val, unsigned char const* const data, bool const littleEndian)
+std::vector<std::vector<int>>
+numaNodes()
 {
-	assert(sizeof(double) == sizeof(std::uint64_t));
-	if (littleEndian) {
-		auto const v2 =
-		    ((std::uint64_t)(data[0])<<0) |
-		    ((std::uint64_t)(data[1])<<8) |
-		    ((std::uint64_t)(data[2])<<16) |
-		    ((std::uint64_t)(data[3])<<24) |
-		    ((std::uint64_t)(data[4])<<32) |
-		    ((std::uint64_t)(data[5])<<40) |
-		    ((std::uint64_t)(data[6])<<48) |
-		    ((std::uint64_t)(data[7])<<56);
-		std::memcpy(val, &v2, sizeof v2);
-	} else {
-		auto const v2 =
-		    ((std::uint64_t)(data[0])<<56) |
-		    ((std::uint64_t)(data[1])<<48) |
-		    ((std::uint64_t)(data[2])<<40) |
-		    ((std::uint64_t)(data[3])<<32) |
-		    ((std::uint64_t)(data[4])<<24) |
-		    ((std::uint64_t)(data[5])<<16) |
-		    ((std::uint64_t)(data[6])<<8) |
-		    ((std::uint64_t)(data[7])<<0);
-		std::memcpy(val, &v2, sizeof v2);
+	std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+	std::vector<int> online;
+	if (readCpuList(&online, "/sys/devices/system/node/online") != 0) {
+		return nodes;
 	}
+	for (auto const node : online) {
+		std::vector<int> cpus;
+		auto const path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+		if (readCpuList(&cpus, path.c_str()) == 0 && !cpus.empty()) {
+			nodes.push_back(cpus);
+		}
+	}
+#endif
+	return nodes;
 }
 
 static
-int
-parseHeader(
-    Header* header,
-    unsigned char const* const data,
-    Epoch const epoch,
-    Endian endian)
+void
+pinThread(std::vector<int> const& cpus)
 {
-	std::int32_t nmag;
-	if (endian == Endian::AUTO) {
-		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, true);
-		if (std::abs(nmag) > 10) {
-			parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, false);
-			if (std::abs(nmag) > 10) {
-				std::fprintf(stderr, "sidus: invalid header\n");
-				return -1;
-			} else {
-				endian = Endian::BIG;
-			}
-		} else {
-			endian = Endian::LITTLE;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto const cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
 		}
 	}
-	else if (endian == Endian::LITTLE) {
-		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, true);
-		if (std::abs(nmag) > 10) {
-				std::fprintf(stderr, "sidus: invalid header, maybe try big-endian?\n");
-				return -1;
+	sched_setaffinity(0, sizeof set, &set);
+#else
+	(void)cpus;
+#endif
+}
+
+/*
+ * The one pool of threads all parallel work runs on, sized by --threads.
+ * Each worker keeps a deque of the tasks it submits and runs the newest
+ * first; out of work, it steals the oldest task of another.  A thread
+ * waiting on a TaskGroup runs tasks meanwhile, taking the oldest of the
+ * tasks submitted from outside the pool first, so the caller makes up
+ * the last of the threads and waiting from within a task never
+ * deadlocks.  With --numa the workers are pinned to the NUMA nodes in
+ * turn, and work that fills a buffer is left to them, so that its pages
+ * are first touched, and so placed, on the node that goes on to use them.
+ */
+class TaskGroup {
+public:
+	TaskGroup()
+	    : pending(0)
+	{
+	}
+
+	TaskGroup(TaskGroup const&) = delete;
+	TaskGroup& operator=(TaskGroup const&) = delete;
+
+private:
+	friend class ThreadPool;
+
+	std::atomic<size_t> pending;
+};
+
+class ThreadPool {
+public:
+	struct Stats {
+		std::atomic<std::uint64_t> tasks;
+		std::atomic<std::uint64_t> stolen;
+		std::atomic<std::uint64_t> nanoseconds;	// running tasks, with --profile
+	};
+
+	ThreadPool()
+	    : numSlots(0), pinned(false), stopping(false), queued(0)
+	{
+		start(1);
+	}
+
+	~ThreadPool()
+	{
+		stop();
+	}
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	// Restarts the pool with numThreads - 1 workers, pinned to the NUMA
+	// nodes if pin is set and there are any; call while idle.
+	void
+	start(int const numThreads, bool const pin = false)
+	{
+		stop();
+		numSlots = std::max(1, numThreads);
+		auto const nodes = pin ? numaNodes() : std::vector<std::vector<int>>();
+		pinned = !nodes.empty();
+		queues.reset(new Queue[numSlots]);
+		stats.reset(new Stats[numSlots]);
+		for (auto i = 0; i < numSlots; ++i) {
+			stats[i].tasks = 0;
+			stats[i].stolen = 0;
+			stats[i].nanoseconds = 0;
+		}
+		stopping = false;
+		for (auto i = 0; i + 1 < numSlots; ++i) {
+			auto const cpus = pinned ? nodes[i%nodes.size()] : std::vector<int>();
+			workers.emplace_back([this, i, cpus] {
+				currentSlot() = i;
+				if (!cpus.empty()) {
+					pinThread(cpus);
+				}
+				work(i);
+			});
 		}
 	}
-	else if (endian == Endian::BIG) {
-		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, false);
-		if (std::abs(nmag) > 10) {
-				std::fprintf(stderr, "sidus: invalid header, maybe try little-endian?\n");
-				return -1;
+
+	// Workers are slots 0 to size() - 2, other threads share the last.
+	int
+	size() const
+	{
+		return numSlots;
+	}
+
+	bool
+	isPinned() const
+	{
+		return pinned;
+	}
+
+	int
+	slot() const
+	{
+		return currentSlot() < 0 ? numSlots - 1 : currentSlot();
+	}
+
+	Stats const&
+	getStats(int const slot) const
+	{
+		return stats[slot];
+	}
+
+	void
+	submit(TaskGroup* group, std::function<void()> run)
+	{
+		++group->pending;
+		auto& queue = queues[slot()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(Task{ group, std::move(run) });
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++queued;
 		}
+		wake.notify_one();
 	}
 
-	auto const littleEndian = endian == Endian::LITTLE;
+	// Runs tasks until done() holds, sleeping only when there are none.
+	template <typename Done>
+	void
+	help(Done done)
+	{
+		auto const self = slot();
+		while (!done()) {
+			if (runOne(self)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return queued > 0 || done(); });
+		}
+	}
 
-	std::int32_t starn;
-	parse(&starn, data + 0 + 4 + 4, littleEndian);
-	std::int32_t stnum;
-	parse(&stnum, data + 0 + 4 + 4 + 4, littleEndian);
-	std::int32_t mprop;
-	parse(&mprop, data + 0 + 4 + 4 + 4 + 4, littleEndian);
-	std::int32_t nbent;
-	parse(&nbent, data + 0 + 4 + 4 + 4 + 4 + 4 + 4, littleEndian);
+	void
+	wait(TaskGroup* group)
+	{
+		help([group] { return group->pending == 0; });
+	}
 
-	if (stnum > Header::INTEGER_STAR_ID) {
-		std::fprintf(stderr, "sidus: invalid STNUM, too large: %d\n", stnum);
-		return -1;
+	// Runs f(0) to f(count - 1) as tasks and waits for them all.
+	template <typename F>
+	void
+	parallelFor(size_t const count, F f)
+	{
+		TaskGroup group;
+		for (size_t i = 0; i < count; ++i) {
+			submit(&group, [&f, i] { f(i); });
+		}
+		wait(&group);
+	}
+
+private:
+	struct Task {
+		TaskGroup* group;
+		std::function<void()> run;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	static
+	int&
+	currentSlot()
+	{
+		static thread_local int slot = -1;
+		return slot;
+	}
+
+	bool
+	take(int const victim, bool const oldest, Task* task)
+	{
+		auto& queue = queues[victim];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) {
+			return false;
+		}
+		if (oldest) {
+			*task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		} else {
+			*task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		return true;
+	}
+
+	bool
+	runOne(int const self)
+	{
+		Task task;
+		auto stolen = false;
+		if (!take(self, self == numSlots - 1, &task)) {
+			auto found = false;
+			for (auto i = 1; i < numSlots && !found; ++i) {
+				found = take((self + i)%numSlots, true, &task);
+			}
+			if (!found) {
+				return false;
+			}
+			stolen = true;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--queued;
+		}
+
+		auto& counts = stats[self];
+		if (profile.enabled) {
+			auto const start = std::chrono::steady_clock::now();
+			task.run();
+			counts.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			    std::chrono::steady_clock::now() - start).count();
+		} else {
+			task.run();
+		}
+		++counts.tasks;
+		counts.stolen += stolen;
+
+		// Whoever waits may be waiting on what the task did.
+		--task.group->pending;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		wake.notify_all();
+		return true;
+	}
+
+	void
+	work(int const self)
+	{
+		for (;;) {
+			if (runOne(self)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return stopping || queued > 0; });
+			if (stopping && queued == 0) {
+				return;
+			}
+		}
+	}
+
+	void
+	stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		workers.clear();
+	}
+
+	int numSlots;
+	bool pinned;
+	std::unique_ptr<Queue[]> queues;
+	std::unique_ptr<Stats[]> stats;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+	size_t queued;
+};
+
+static ThreadPool pool;
+
+/*
+ * Allocator for the large arrays: decoded columns, sort entries and whole
+ * input files.  Elements are left uninitialised rather than zeroed, so
+ * each page is first touched by the thread that fills it rather than by
+ * the one sizing the array.  With --huge-pages, arrays of a huge page or
+ * more are mapped on huge pages, reserved ones if the system has any and
+ * transparent ones otherwise.
+ */
+static bool hugePages = false;
+static size_t const HUGE_PAGE_SIZE = 2 << 20;
+
+static
+void*
+allocatePages(size_t const size)
+{
+#if defined(__linux__)
+	if (hugePages && size >= HUGE_PAGE_SIZE) {
+		auto const length = (size + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+		auto p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED) {
+			p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				throw std::bad_alloc();
+			}
+			madvise(p, length, MADV_HUGEPAGE);
+		}
+		countAllocation();
+		return p;
+	}
+#endif
+	return ::operator new(size);
+}
+
+static
+void
+freePages(void* const p, size_t const size)
+{
+#if defined(__linux__)
+	if (hugePages && size >= HUGE_PAGE_SIZE) {
+		munmap(p, (size + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE);
+		return;
+	}
+#endif
+	::operator delete(p);
+}
+
+template <typename T>
+struct PageAllocator {
+	typedef T value_type;
+
+	PageAllocator()
+	{
+	}
+
+	template <typename U>
+	PageAllocator(PageAllocator<U> const&)
+	{
+	}
+
+	T*
+	allocate(size_t const n)
+	{
+		return (T*)allocatePages(n*sizeof(T));
+	}
+
+	void
+	deallocate(T* const p, size_t const n)
+	{
+		freePages(p, n*sizeof(T));
+	}
+
+	template <typename U>
+	void
+	construct(U* const p)
+	{
+		::new((void*)p) U;
+	}
+
+	template <typename U, typename... Args>
+	void
+	construct(U* const p, Args&&... args)
+	{
+		::new((void*)p) U(std::forward<Args>(args)...);
+	}
+};
+
+template <typename T, typename U>
+static
+bool
+operator==(PageAllocator<T> const&, PageAllocator<U> const&)
+{
+	return true;
+}
+
+template <typename T, typename U>
+static
+bool
+operator!=(PageAllocator<T> const&, PageAllocator<U> const&)
+{
+	return false;
+}
+
+template <typename T>
+using PageVector = std::vector<T, PageAllocator<T>>;
+
+static
+long
+peakResidentKilobytes()
+{
+#if defined(__unix__)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_maxrss;
+	}
+#endif
+	return -1;
+}
+
+static
+void
+printProfile(FILE* f)
+{
+	auto const wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now() - profile.start).count()*1e-9;
+	auto const rss = peakResidentKilobytes();
+	auto const allocations = (unsigned long long)numAllocations;
+
+	if (profile.json) {
+		std::fprintf(f, "{\"wall_seconds\":%.6f,\"peak_rss_kb\":%ld,\"allocations\":%llu,\"phases\":{",
+			     wall, rss, allocations);
+		for (auto i = 0; i < NUM_PHASES; ++i) {
+			auto const seconds = profile.nanoseconds[i]*1e-9;
+			std::fprintf(f,
+				     "%s\"%s\":{\"seconds\":%.6f,\"bytes\":%llu,\"stars\":%llu,"
+				     "\"bytes_per_second\":%.0f,\"stars_per_second\":%.0f",
+				     i ? "," : "", phaseNames[i], seconds,
+				     (unsigned long long)profile.bytes[i],
+				     (unsigned long long)profile.stars[i],
+				     seconds > 0.0 ? profile.bytes[i]/seconds : 0.0,
+				     seconds > 0.0 ? profile.stars[i]/seconds : 0.0);
+			if (profile.counters && !profile.countersMissing) {
+				for (auto j = 0; j < NUM_COUNTERS; ++j) {
+					std::fprintf(f, ",\"%s\":%llu", counterNames[j],
+						     (unsigned long long)profile.events[i][j]);
+				}
+			}
+			std::fputc('}', f);
+		}
+		std::fprintf(f, "},\"counters\":%s,\"threads\":[",
+			     !profile.counters ? "\"off\"" :
+			     profile.countersMissing ? "\"unavailable\"" : "\"on\"");
+		for (auto i = 0; i < pool.size(); ++i) {
+			auto const& stats = pool.getStats(i);
+			std::fprintf(f, "%s{\"tasks\":%llu,\"stolen\":%llu,\"busy_seconds\":%.6f}",
+				     i ? "," : "",
+				     (unsigned long long)stats.tasks,
+				     (unsigned long long)stats.stolen,
+				     stats.nanoseconds*1e-9);
+		}
+		std::fputs("]}\n", f);
+		return;
+	}
+
+	std::fprintf(f, "Profile:\n %-8s %12s %12s %12s %14s\n",
+		     "phase", "seconds", "stars", "MB/s", "stars/s");
+	for (auto i = 0; i < NUM_PHASES; ++i) {
+		auto const seconds = profile.nanoseconds[i]*1e-9;
+		std::fprintf(f, " %-8s %12.6f %12llu %12.1f %14.0f\n",
+			     phaseNames[i], seconds,
+			     (unsigned long long)profile.stars[i],
+			     seconds > 0.0 ? profile.bytes[i]/seconds/1e6 : 0.0,
+			     seconds > 0.0 ? profile.stars[i]/seconds : 0.0);
+	}
+	std::fprintf(f,
+		     " Wall time: %.6f seconds\n"
+		     " Peak resident set: %ld kB\n"
+		     " Allocations: %llu\n",
+		     wall, rss, allocations);
+	std::fprintf(f, " %-8s %12s %12s %12s %8s\n",
+		     "thread", "tasks", "stolen", "busy", "busy %");
+	for (auto i = 0; i < pool.size(); ++i) {
+		auto const& stats = pool.getStats(i);
+		auto const busy = stats.nanoseconds*1e-9;
+		std::fprintf(f, " %-8s %12llu %12llu %12.6f %8.1f\n",
+			     i + 1 < pool.size() ? std::to_string(i).c_str() : "caller",
+			     (unsigned long long)stats.tasks,
+			     (unsigned long long)stats.stolen,
+			     busy, wall > 0.0 ? 100.0*busy/wall : 0.0);
+	}
+
+	if (!profile.counters) {
+		return;
+	}
+	if (profile.countersMissing) {
+		std::fputs(" Hardware counters: unavailable\n", f);
+		return;
+	}
+	std::fprintf(f, " %-8s %8s %16s %16s %16s\n",
+		     "phase", "IPC", "cache misses", "branch misses", "cycles");
+	for (auto i = 0; i < NUM_PHASES; ++i) {
+		auto const& events = profile.events[i];
+		auto const cycles = (double)events[COUNTER_CYCLES];
+		std::fprintf(f, " %-8s %8.2f %16llu %16llu %16llu\n",
+			     phaseNames[i],
+			     cycles > 0.0 ? events[COUNTER_INSTRUCTIONS]/cycles : 0.0,
+			     (unsigned long long)events[COUNTER_CACHE_MISSES],
+			     (unsigned long long)events[COUNTER_BRANCH_MISSES],
+			     (unsigned long long)events[COUNTER_CYCLES]);
+	}
+}
+
+static
+void
+parse(std::int16_t* val, unsigned char const* const data, bool const littleEndian)
+{
+	if (littleEndian) {
+		*val =
+		    ((short)(data[0])<<0) |
+		    ((short)(data[1])<<8);
+	} else {
+		*val = 
+		    ((short)(data[0])<<8) |
+		    ((short)(data[1])<<0);
+	}
+}
+
+static
+void
+parse(std::int32_t* val, unsigned char const* const data, bool const littleEndian)
+{
+	if (littleEndian) {
+		*val =
+		    ((int)(data[0])<<0) |
+		    ((int)(data[1])<<8) |
+		    ((int)(data[2])<<16) |
+		    ((int)(data[3])<<24);
+	} else {
+		*val =
+		    ((int)(data[0])<<24) |
+		    ((int)(data[1])<<16) |
+		    ((int)(data[2])<<8) |
+		    ((int)(data[3])<<0);
+	}
+}
+
+static
+void
+parse(float* val, unsigned char const* const data, bool const littleEndian)
+{
+	assert(sizeof(float) == sizeof(std::uint32_t));
+	if (littleEndian) {
+		auto const v2 =
+		    ((std::uint32_t)(data[0])<<0) |
+		    ((std::uint32_t)(data[1])<<8) |
+		    ((std::uint32_t)(data[2])<<16) |
+		    ((std::uint32_t)(data[3])<<24);
+		std::memcpy(val, &v2, sizeof v2);
+	} else {
+		auto const v2 =
+		    ((std::uint32_t)(data[0])<<24) |
+		    ((std::uint32_t)(data[1])<<16) |
+		    ((std::uint32_t)(data[2])<<8) |
+		    ((std::uint32_t)(data[3])<<0);
+		std::memcpy(val, &v2, sizeof v2);
+	}
+}
+
+static
+void
+parse(double* val, unsigned char const* const data, bool const littleEndian)
+{
+	assert(sizeof(double) == sizeof(std::uint64_t));
+	if (littleEndian) {
+		auto const v2 =
+		    ((std::uint64_t)(data[0])<<0) |
+		    ((std::uint64_t)(data[1])<<8) |
+		    ((std::uint64_t)(data[2])<<16) |
+		    ((std::uint64_t)(data[3])<<24) |
+		    ((std::uint64_t)(data[4])<<32) |
+		    ((std::uint64_t)(data[5])<<40) |
+		    ((std::uint64_t)(data[6])<<48) |
+		    ((std::uint64_t)(data[7])<<56);
+		std::memcpy(val, &v2, sizeof v2);
+	} else {
+		auto const v2 =
+		    ((std::uint64_t)(data[0])<<56) |
+		    ((std::uint64_t)(data[1])<<48) |
+		    ((std::uint64_t)(data[2])<<40) |
+		    ((std::uint64_t)(data[3])<<32) |
+		    ((std::uint64_t)(data[4])<<24) |
+		    ((std::uint64_t)(data[5])<<16) |
+		    ((std::uint64_t)(data[6])<<8) |
+		    ((std::uint64_t)(data[7])<<0);
+		std::memcpy(val, &v2, sizeof v2);
+	}
+}
+
+static
+int
+parseHeader(
+    Header* header,
+    unsigned char const* const data,
+    Epoch const epoch,
+    Endian endian)
+{
+	std::int32_t nmag;
+	if (endian == Endian::AUTO) {
+		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, true);
+		if (std::abs(nmag) > 10) {
+			parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, false);
+			if (std::abs(nmag) > 10) {
+				std::fprintf(stderr, "sidus: invalid header\n");
+				return -1;
+			} else {
+				endian = Endian::BIG;
+			}
+		} else {
+			endian = Endian::LITTLE;
+		}
+	}
+	else if (endian == Endian::LITTLE) {
+		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, true);
+		if (std::abs(nmag) > 10) {
+				std::fprintf(stderr, "sidus: invalid header, maybe try big-endian?\n");
+				return -1;
+		}
+	}
+	else if (endian == Endian::BIG) {
+		parse(&nmag, data + 0 + 4 + 4 + 4 + 4 + 4, false);
+		if (std::abs(nmag) > 10) {
+				std::fprintf(stderr, "sidus: invalid header, maybe try little-endian?\n");
+				return -1;
+		}
+	}
+
+	auto const littleEndian = endian == Endian::LITTLE;
+
+	std::int32_t starn;
+	parse(&starn, data + 0 + 4 + 4, littleEndian);
+	std::int32_t stnum;
+	parse(&stnum, data + 0 + 4 + 4 + 4, littleEndian);
+	std::int32_t mprop;
+	parse(&mprop, data + 0 + 4 + 4 + 4 + 4, littleEndian);
+	std::int32_t nbent;
+	parse(&nbent, data + 0 + 4 + 4 + 4 + 4 + 4 + 4, littleEndian);
+
+	if (stnum > Header::INTEGER_STAR_ID) {
+		std::fprintf(stderr, "sidus: invalid STNUM, too large: %d\n", stnum);
+		return -1;
 	}
 
 	if (mprop < 0) {
 		std::fprintf(stderr, "sidus: invalid MPROP, negative: %d\n", mprop);
 		return -1;
 	}
-	if (mprop > Header::RADIAL_VELOCITY) {
-		std::fprintf(stderr, "sidus: invalid MPROP, too large: %d\n", mprop);
+	if (mprop > Header::RADIAL_VELOCITY) {
+		std::fprintf(stderr, "sidus: invalid MPROP, too large: %d\n", mprop);
+		return -1;
+	}
+
+	auto const isJ2000 = starn < 0 || nmag < 0;
+	if (epoch == Epoch::J2000 && !isJ2000) {
+		std::fprintf(stderr, "sidus: expected J2000 epoch but found B1950 epoch\n");
+		return -1;
+	}
+	else if (epoch == Epoch::B1950 && isJ2000) {
+		std::fprintf(stderr, "sidus: expected B1950 epoch but found J2000 epoch\n");
+		return -1;
+	}
+
+	header->numStars = std::abs(starn);
+	header->starId = stnum < 0 ? Header::NO_STAR_ID : (Header::StarId)stnum;
+	header->starNameLength = stnum < 0 ? -stnum : 0;
+	header->properMotion = (Header::ProperMotion)mprop;
+	header->numMagnitudes = std::abs(nmag);
+	header->numBytesPerStar = nbent;
+	header->epoch = isJ2000 ? Epoch::J2000 : Epoch::B1950;
+	header->littleEndian = littleEndian;
+
+	return 0;
+}
+
+static
+int
+parseStar(
+    Star* star,
+    Header const& header,
+    unsigned char const* const data,
+    Arena* names)
+{
+	auto const littleEndian = header.littleEndian;
+	auto cursor = 0;
+
+	double xno = 0.0;
+	if (header.starId == Header::CATALOG_STAR_ID ||
+	    header.starId == Header::GSC_STAR_ID ||
+	    header.starId == Header::TYCHO_STAR_ID) {
+		float xno2;
+		parse(&xno2, data + cursor, littleEndian);
+		xno = xno2;
+		cursor += 4;
+	}
+        else if (header.starId == Header::INTEGER_STAR_ID) {
+		std::int32_t xno2;
+		parse(&xno2, data + cursor, littleEndian);
+		xno = xno2;
+		cursor += 4;
+	}
+
+	double ra;
+	parse(&ra, data + cursor, littleEndian);
+	cursor += 8;
+	double decl;
+	parse(&decl, data + cursor, littleEndian);
+	cursor += 8;
+	char isp[2];
+	isp[0] = *(data + cursor++);
+	isp[1] = *(data + cursor++);
+	std::int16_t mags[MAX_MAGNITUDES];
+	for (auto i = 0; i < header.numMagnitudes; ++i, cursor += 2) {
+		parse(&mags[i], data + cursor, littleEndian);
+	}
+	float xrpm = 0.0f;
+	float xdpm = 0.0f;
+	double svel = 0.0;
+	if (header.properMotion == Header::PROPER_MOTION) {
+		parse(&xrpm, data + cursor, littleEndian);
+		cursor += 4;
+		parse(&xdpm, data + cursor, littleEndian);
+		cursor += 4;
+	}
+	else if (header.properMotion == Header::RADIAL_VELOCITY) {
+		parse(&svel, data + cursor, littleEndian);
+		cursor += 8;
+	}
+	star->name = header.starNameLength > 0 ?
+	    names->copy((char const*)(data + cursor), header.starNameLength) : "";
+	star->rightAscension = ra;
+	star->declination = decl;
+	star->starId = xno;
+	for (auto i = 0; i < header.numMagnitudes; ++i) {
+		star->magnitudes[i] = (float)(mags[i])/100.0f;
+	}
+	star->magnitude = star->magnitudes[header.apparentMagnitude];
+	star->properMotion.rightAscension = xrpm;
+	star->properMotion.declination = xdpm;
+	star->radialVelocity = svel;
+	star->spectralType[0] = isp[0];
+	star->spectralType[1] = isp[1];
+	star->spectralType[2] = '\0';
+	star->level = 0;
+	star->aggregated = 0;
+
+	return 0;
+}
+
+static
+std::string
+sanitizeForC(char const * cs)
+{
+	std::string s;
+	for (auto i = 0u; cs[i]; ++i) {
+		auto const c = std::tolower(cs[i]);
+		if (i == 0) {
+			if (isalpha(c)) {
+				s.push_back(c);
+			} else {
+				s.push_back('x');
+			}
+		} else {
+			if (isalnum(c)) {
+				s.push_back(c);
+			} else {
+				s.push_back('_');
+			}
+		}
+	}
+	return s;
+}
+
+struct Format {
+	bool cformat = false;
+	bool usefloat = false;
+	bool usename = false;
+	bool usetype = false;
+	std::vector<int> bands;			// extra magnitudes to output
+	std::vector<std::pair<int, int>> colors;	// differences of two magnitudes
+	bool cull = false;			// emit a culling function, see printCCull
+	bool lod = false;			// output level and aggregated count
+};
+
+static
+void
+appendf(std::string* out, char const* const fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	auto const n = std::vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n < sizeof buf) {
+		out->append(buf, n);
+		return;
+	}
+	auto const offset = out->size();
+	out->resize(offset + n + 1);
+	va_start(ap, fmt);
+	std::vsnprintf(&(*out)[offset], n + 1, fmt, ap);
+	va_end(ap);
+	out->resize(offset + n);
+}
+
+static
+void
+printCHeader(std::string* out,
+	     char const* const inputfile,
+	     unsigned const numStars,
+	     Epoch const epoch,
+	     Format const& format)
+{
+	auto const var = sanitizeForC(inputfile);
+
+	appendf(out,
+		"/*\n"
+		" * Auto-generated from catalog %s by the sidus program\n"
+		" *\n"
+		" * Do this:\n"
+		" *   #define SIDUS_IMPLEMENTATION\n"
+		" * before you include this file in *one* C or C++ file to create the implementation\n"
+		" *\n"
+		" */\n\n",
+		inputfile);
+	appendf(out,
+		"#ifndef %s_h\n"
+		"#define %s_h\n\n",
+		var.c_str(), var.c_str());
+	out->append("#ifdef __cplusplus\n"
+		    "extern \"C\" {\n"
+		    "#endif\n\n");
+
+	out->append("struct Star {\n");
+	auto const epochstr = epoch == Epoch::J2000 ? "J2000" : "B1950";
+	auto const real = format.usefloat ? "float" : "double";
+	appendf(out,
+		"	%s rightAscension;	/* radians, %s */\n"
+		"	%s declination;	/* radians, %s */\n"
+		"	%s magnitude;\n",
+		real, epochstr, real, epochstr, real);
+	for (auto const band : format.bands) {
+		appendf(out, "	%s mag%d;\n", real, band);
+	}
+	for (auto const& color : format.colors) {
+		appendf(out, "	%s color%d_%d;	/* mag%d - mag%d */\n",
+			real, color.first, color.second, color.first, color.second);
+	}
+	if (format.usename) {
+		out->append("	const char *name;\n");
+	}
+	if (format.usetype) {
+		out->append("	const char *type;\n");
+	}
+	if (format.lod) {
+		out->append("	unsigned char level;\n"
+			    "	unsigned aggregated;	/* stars summed into this one, 0 for a star */\n");
+	}
+	appendf(out,
+		"};\n\n"
+		"enum { %s_num_stars = %u };\n\n",
+		var.c_str(), numStars);
+	if (format.cull) {
+		appendf(out,
+			"/*\n"
+			" * Writes the indices into %s_stars of up to max stars no fainter than\n"
+			" * maxMagnitude inside the view of a camera to indices, and returns how\n"
+			" * many it wrote.  forward and up are unit vectors in the equatorial\n"
+			" * frame, fovY is the vertical field of view in radians and aspect the\n"
+			" * width over the height of the view.\n"
+			" */\n"
+			"unsigned %s_cull(const float forward[3], const float up[3], float fovY,\n"
+			"    float aspect, float maxMagnitude, unsigned *indices, unsigned max);\n\n",
+			var.c_str(), var.c_str());
+	}
+	appendf(out,
+		"#ifndef SIDUS_IMPLEMENTATION\n"
+		"extern const struct Star * %s_stars;\n"
+		"#else\n"
+		"const struct Star %s_stars[%u] = {",
+		var.c_str(),
+		var.c_str(), numStars);
+}
+
+static
+void
+printCFooter(std::string* out, std::string const& implementation)
+{
+	out->append("\n};\n\n");
+	out->append(implementation);
+	out->append("#endif\n\n"
+		    "#ifdef __cplusplus\n"
+		    "}\n"
+		    "#endif\n\n"
+		    "#endif\n");
+}
+
+
+static
+void
+print(
+    std::string* out,
+    Star const& star,
+    Header const & header,
+    int const idx,
+    Format const& format)
+{
+	auto const usefloat = format.usefloat;
+	if (format.cformat) {
+		if (idx != 0) {
+			out->append(", ");
+		}
+		if (usefloat) {
+			appendf(out,
+				"\n	{ % .9f, % .9f, % .9f",
+				star.rightAscension,
+				star.declination,
+				star.magnitude);
+		} else {
+			appendf(out,
+				"\n	{ % .17lf, % .17lf, % .17lf",
+				star.rightAscension,
+				star.declination,
+				star.magnitude);
+		}
+		for (auto const band : format.bands) {
+			appendf(out, usefloat ? ", % .9f" : ", % .17lf", star.magnitudes[band]);
+		}
+		for (auto const& color : format.colors) {
+			appendf(out, usefloat ? ", % .9f" : ", % .17lf",
+				star.magnitudes[color.first] - star.magnitudes[color.second]);
+		}
+		if (format.usename) {
+			appendf(out,
+				", \"%s\"",
+				star.name);
+		}
+		if (format.usetype) {
+			appendf(out,
+				", \"%s\"",
+				star.spectralType);
+		}
+		if (format.lod) {
+			appendf(out, ", %d, %u", star.level, (unsigned)star.aggregated);
+		}
+		out->append(" }");
+	} else {
+		if (format.usename) {
+			appendf(out, "%s,", star.name);
+		}
+		if (usefloat) {
+			appendf(out,
+				"%.9f,%.9f,%.9f",
+				star.rightAscension,
+				star.declination,
+				star.magnitude);
+		} else {
+			appendf(out,
+				"%.17lf,%.17lf,%.17lf",
+				star.rightAscension,
+				star.declination,
+				star.magnitude);
+		}
+		for (auto const band : format.bands) {
+			appendf(out, usefloat ? ",%.9f" : ",%.17lf", star.magnitudes[band]);
+		}
+		for (auto const& color : format.colors) {
+			appendf(out, usefloat ? ",%.9f" : ",%.17lf",
+				star.magnitudes[color.first] - star.magnitudes[color.second]);
+		}
+		if (format.usetype) {
+			appendf(out,
+				",%c%c",
+				star.spectralType[0],
+				star.spectralType[1]);
+		}
+		if (format.lod) {
+			appendf(out, ",%d,%u", star.level, (unsigned)star.aggregated);
+		}
+		out->push_back('\n');
+	}
+}
+
+/*
+ * Nested HEALPix index of a position, cf. Gorski et al. 2005.  Cells at
+ * a coarser order are found by shifting the index right by two bits per
+ * order.
+ */
+static int const HEALPIX_ORDER = 12;
+static int const CELL_HEALPIX_ORDER = 4;	// cells of about 3.7 degrees
+
+static
+std::uint64_t
+spreadBits(std::uint64_t v)
+{
+	v &= 0xffffffffu;
+	v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+	v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+	v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+	v = (v | (v << 2)) & 0x3333333333333333ull;
+	v = (v | (v << 1)) & 0x5555555555555555ull;
+	return v;
+}
+
+static
+std::uint64_t
+healpixIndex(double const rightAscension, double const declination, int const order)
+{
+	auto const nside = (std::int64_t)1 << order;
+	auto const z = std::sin(declination);
+	auto const za = std::fabs(z);
+	auto tt = std::fmod(rightAscension, 2.0*M_PI);
+	if (tt < 0.0) {
+		tt += 2.0*M_PI;
+	}
+	tt *= 2.0/M_PI;	// in [0,4)
+
+	std::int64_t face, ix, iy;
+	if (za <= 2.0/3.0) {
+		auto const temp1 = nside*(0.5 + tt);
+		auto const temp2 = nside*z*0.75;
+		auto const jp = (std::int64_t)(temp1 - temp2);
+		auto const jm = (std::int64_t)(temp1 + temp2);
+		auto const ifp = jp >> order;
+		auto const ifm = jm >> order;
+		face = ifp == ifm ? (ifp | 4) : (ifp < ifm ? ifp : ifm + 8);
+		ix = jm & (nside - 1);
+		iy = nside - (jp & (nside - 1)) - 1;
+	} else {
+		auto const ntt = std::min((std::int64_t)3, (std::int64_t)tt);
+		auto const tp = tt - ntt;
+		auto const tmp = nside*std::sqrt(3.0*(1.0 - za));
+		auto const jp = std::min(nside - 1, (std::int64_t)(tp*tmp));
+		auto const jm = std::min(nside - 1, (std::int64_t)((1.0 - tp)*tmp));
+		if (z >= 0.0) {
+			face = ntt;
+			ix = nside - jm - 1;
+			iy = nside - jp - 1;
+		} else {
+			face = ntt + 8;
+			ix = jp;
+			iy = jm;
+		}
+	}
+	return ((std::uint64_t)face << (2*order)) | spreadBits(ix) | (spreadBits(iy) << 1);
+}
+
+/*
+ * Sorting works on composite keys: the selected sort keys are each
+ * encoded into an unsigned integer whose order matches the order of the
+ * values, and packed most significant first into one or more 64-bit
+ * words.  Comparing the words then orders by every key at once, so a
+ * multi-key sort is still a single radix sort.  Small inputs are sorted
+ * with a stable comparison sort, large ones with a parallel LSD radix
+ * sort, which is stable as well; ties keep their file order either way.
+ */
+enum class SortField { MAG, RA, DEC, ID, SPECTRAL, HEALPIX, CELL };
+
+struct SortKey {
+	SortField field;
+	bool descending;	// encoded by inverting the key bits
+};
+
+static int const MAX_KEY_WORDS = 5;
+
+template <int N>
+struct SortEntry {
+	std::uint64_t key[N];
+	std::uint32_t index;
+};
+
+static size_t const PARALLEL_SORT_THRESHOLD = 1u << 16;
+
+static
+int
+keyBits(SortField const field)
+{
+	switch (field) {
+	case SortField::MAG:
+		return 32;
+	case SortField::SPECTRAL:
+		return 17;
+	case SortField::HEALPIX:
+		return 4 + 2*HEALPIX_ORDER;
+	case SortField::CELL:
+		return 4 + 2*CELL_HEALPIX_ORDER;
+	default:
+		return 64;
+	}
+}
+
+static
+int
+parseSortKeys(std::vector<SortKey>* keys, std::string const& spec)
+{
+	keys->clear();
+	auto bits = 0;
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		auto end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		auto name = spec.substr(begin, end - begin);
+		SortKey key;
+		key.descending = false;
+		auto const colon = name.find(':');
+		if (colon != std::string::npos) {
+			auto const direction = name.substr(colon + 1);
+			if (direction == "desc") {
+				key.descending = true;
+			}
+			else if (direction != "asc") {
+				std::fprintf(stderr, "sidus: unknown sort direction '%s'\n", direction.c_str());
+				return -1;
+			}
+			name.resize(colon);
+		}
+		if (name == "mag") {
+			key.field = SortField::MAG;
+		}
+		else if (name == "ra") {
+			key.field = SortField::RA;
+		}
+		else if (name == "dec") {
+			key.field = SortField::DEC;
+		}
+		else if (name == "id") {
+			key.field = SortField::ID;
+		}
+		else if (name == "spectral") {
+			key.field = SortField::SPECTRAL;
+		}
+		else if (name == "healpix") {
+			key.field = SortField::HEALPIX;
+		}
+		else if (name == "cell") {
+			key.field = SortField::CELL;
+		} else {
+			std::fprintf(stderr, "sidus: unknown sort key '%s'\n", name.c_str());
+			return -1;
+		}
+		for (auto const& other : *keys) {
+			if (other.field == key.field) {
+				std::fprintf(stderr, "sidus: sort key '%s' given twice\n", name.c_str());
+				return -1;
+			}
+		}
+		keys->push_back(key);
+		bits += keyBits(key.field);
+		begin = end + 1;
+	}
+	assert(bits <= 64*MAX_KEY_WORDS);
+	return 0;
+}
+
+static
+int
+keyWords(std::vector<SortKey> const& keys)
+{
+	auto bits = 0;
+	for (auto const& key : keys) {
+		bits += keyBits(key.field);
+	}
+	return (bits + 63)/64;
+}
+
+static
+std::uint64_t
+encodeKey(double value)
+{
+	if (value == 0.0) {
+		value = 0.0;	// -0.0 and 0.0 compare equal
+	}
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	auto const sign = (std::uint64_t)1 << 63;
+	return (bits & sign) ? ~bits : bits | sign;
+}
+
+static
+std::uint64_t
+encodeKey(float value)
+{
+	if (value == 0.0f) {
+		value = 0.0f;
+	}
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	auto const sign = (std::uint32_t)1 << 31;
+	return (bits & sign) ? (std::uint32_t)~bits : bits | sign;
+}
+
+/*
+ * Spectral classes in temperature order, subclasses after that.  Types
+ * not in the sequence sort after all that are, by their first byte, so
+ * the rank takes 9 bits and the key 17.
+ */
+static
+std::uint64_t
+encodeSpectralKey(char const* const spectralType)
+{
+	static char const sequence[] = "OBAFGKMLTY";
+	auto const found = spectralType[0] ?
+	    std::strchr(sequence, std::toupper((unsigned char)spectralType[0])) : nullptr;
+	auto const rank = found ? (std::uint64_t)(found - sequence) : 0x80u + (unsigned char)spectralType[0];
+	return (rank << 8) | (unsigned char)spectralType[1];
+}
+
+static
+std::uint64_t
+encodeKey(Star const& star, SortField const field)
+{
+	switch (field) {
+	case SortField::MAG:
+		return encodeKey(star.magnitude);
+	case SortField::RA:
+		return encodeKey(star.rightAscension);
+	case SortField::DEC:
+		return encodeKey(star.declination);
+	case SortField::ID:
+		return encodeKey(star.starId);
+	case SortField::SPECTRAL:
+		return encodeSpectralKey(star.spectralType);
+	case SortField::HEALPIX:
+		return healpixIndex(star.rightAscension, star.declination, HEALPIX_ORDER);
+	case SortField::CELL:
+		return healpixIndex(star.rightAscension, star.declination, CELL_HEALPIX_ORDER);
+	}
+	return 0;
+}
+
+template <int N>
+static
+void
+encodeKeys(
+    SortEntry<N>* entry,
+    Star const& star,
+    std::vector<SortKey> const& keys)
+{
+	for (auto i = 0; i < N; ++i) {
+		entry->key[i] = 0;
+	}
+	auto bit = 0;
+	for (auto const& key : keys) {
+		auto const width = keyBits(key.field);
+		auto value = encodeKey(star, key.field);
+		if (key.descending) {
+			value = ~value;
+			if (width < 64) {
+				value &= ((std::uint64_t)1 << width) - 1;
+			}
+		}
+		// Place the value at bits [bit, bit + width), counted from the
+		// most significant bit of the first word.
+		auto const word = bit/64;
+		auto const used = bit%64;
+		// keyWords() sized N to hold every key, so a value only ever
+		// spills into a next word when there is one.
+		if (used + width <= 64) {
+			entry->key[word] |= width == 64 ? value : value << (64 - used - width);
+		} else if (N > 1 && word + 1 < N) {
+			auto const spill = used + width - 64;
+			entry->key[word] |= value >> spill;
+			entry->key[word + 1] |= value << (64 - spill);
+		}
+		bit += width;
+	}
+}
+
+template <int N>
+static
+void
+radixSort(PageVector<SortEntry<N>>* entries, int const numThreads)
+{
+	auto const n = entries->size();
+	auto const numParts = (size_t)std::max(1, numThreads);
+	auto const partSize = (n + numParts - 1)/numParts;
+	PageVector<SortEntry<N>> scratch(n);
+	auto* src = entries;
+	auto* dst = &scratch;
+	std::vector<std::array<size_t, 256>> counts(numParts);
+
+	for (auto digit = 0; digit < 8*N; ++digit) {
+		auto const word = N - 1 - digit/8;
+		auto const shift = 8*(digit%8);
+		auto histogram = [&](size_t const part) {
+			auto& count = counts[part];
+			count.fill(0);
+			auto const end = std::min(n, (part + 1)*partSize);
+			for (auto i = part*partSize; i < end; ++i) {
+				++count[((*src)[i].key[word] >> shift) & 0xff];
+			}
+		};
+		pool.parallelFor(numParts, histogram);
+
+		// A digit shared by every key leaves the order untouched.
+		auto trivial = false;
+		for (auto value = 0; value < 256 && !trivial; ++value) {
+			size_t total = 0;
+			for (size_t part = 0; part < numParts; ++part) {
+				total += counts[part][value];
+			}
+			trivial = total == n;
+		}
+		if (trivial) {
+			continue;
+		}
+
+		// Turn the counts into starting offsets, digit value major and
+		// part minor, which is what keeps the pass stable.
+		size_t offset = 0;
+		for (auto value = 0; value < 256; ++value) {
+			for (size_t part = 0; part < numParts; ++part) {
+				auto const count = counts[part][value];
+				counts[part][value] = offset;
+				offset += count;
+			}
+		}
+
+		auto scatter = [&](size_t const part) {
+			auto& next = counts[part];
+			auto const end = std::min(n, (part + 1)*partSize);
+			for (auto i = part*partSize; i < end; ++i) {
+				auto const& entry = (*src)[i];
+				(*dst)[next[(entry.key[word] >> shift) & 0xff]++] = entry;
+			}
+		};
+		pool.parallelFor(numParts, scatter);
+		std::swap(src, dst);
+	}
+
+	if (src != entries) {
+		entries->swap(*src);
+	}
+}
+
+template <int N>
+static
+void
+sortStars(
+    std::vector<std::uint32_t>* order,
+    std::vector<Star> const& stars,
+    std::vector<SortKey> const& keys,
+    int const numThreads)
+{
+	// Keys are encoded in the parts the radix sort counts in, so that
+	// a part's pages are first touched by a thread about to use them.
+	auto const n = stars.size();
+	auto const parallel = n >= PARALLEL_SORT_THRESHOLD && numThreads > 1;
+	auto const numParts = parallel ? (size_t)numThreads : 1;
+	auto const partSize = (n + numParts - 1)/numParts;
+	PageVector<SortEntry<N>> entries(n);
+	pool.parallelFor(numParts, [&](size_t const part) {
+		auto const end = std::min(n, (part + 1)*partSize);
+		for (auto i = part*partSize; i < end; ++i) {
+			encodeKeys(&entries[i], stars[i], keys);
+			entries[i].index = (std::uint32_t)i;
+		}
+	});
+
+	if (!parallel) {
+		std::stable_sort(entries.begin(), entries.end(),
+		    [](SortEntry<N> const& a, SortEntry<N> const& b) {
+			    return std::lexicographical_compare(a.key, a.key + N, b.key, b.key + N);
+		    });
+	} else {
+		radixSort(&entries, numThreads);
+	}
+
+	order->resize(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		(*order)[i] = entries[i].index;
+	}
+}
+
+static
+void
+sortStars(
+    std::vector<std::uint32_t>* order,
+    std::vector<Star> const& stars,
+    std::vector<SortKey> const& keys,
+    int const numThreads)
+{
+	switch (keyWords(keys)) {
+	case 0:
+		// No keys, as for an unsorted --shard: file order as it is.
+		order->resize(stars.size());
+		for (size_t i = 0; i < stars.size(); ++i) {
+			(*order)[i] = (std::uint32_t)i;
+		}
+		break;
+	case 1:
+		sortStars<1>(order, stars, keys, numThreads);
+		break;
+	case 2:
+		sortStars<2>(order, stars, keys, numThreads);
+		break;
+	case 3:
+		sortStars<3>(order, stars, keys, numThreads);
+		break;
+	case 4:
+		sortStars<4>(order, stars, keys, numThreads);
+		break;
+	default:
+		sortStars<MAX_KEY_WORDS>(order, stars, keys, numThreads);
+		break;
+	}
+}
+
+/*
+ * --cull: the stars are sorted by HEALPix cell and by magnitude within
+ * each cell, and the C header gets a table of cells, each with a cap
+ * bounding its stars, the stars' unit vectors in separate x, y and z
+ * arrays, and a function culling against the four side planes of a view.
+ * Cells entirely outside a plane or fainter than the limit are skipped,
+ * cells entirely inside are taken whole, and the rest are tested star by
+ * star, a block at a time in a loop compilers turn into SIMD code.
+ */
+static
+void
+printCCull(
+    std::string* out,
+    char const* const inputfile,
+    std::vector<Star> const& stars,
+    std::vector<std::uint32_t> const& order)
+{
+	auto const var = sanitizeForC(inputfile);
+	auto const n = order.size();
+	std::vector<double> x(n), y(n), z(n);
+	for (size_t i = 0; i < n; ++i) {
+		auto const& star = stars[order[i]];
+		x[i] = std::cos(star.declination)*std::cos(star.rightAscension);
+		y[i] = std::cos(star.declination)*std::sin(star.rightAscension);
+		z[i] = std::sin(star.declination);
+	}
+
+	out->append("#include <math.h>\n\n"
+		    "static const struct {\n"
+		    "	float x, y, z;	/* center of the cap around the stars of the cell */\n"
+		    "	float sinRadius;	/* 2 if the cap is wider than a hemisphere */\n"
+		    "	float brightest;\n"
+		    "	unsigned first, count;\n");
+	appendf(out, "} %s_cells[] = {", var.c_str());
+	auto numCells = 0;
+	for (size_t first = 0, last; first < n; first = last) {
+		auto const& star = stars[order[first]];
+		auto const cell = healpixIndex(star.rightAscension, star.declination, CELL_HEALPIX_ORDER);
+		double cx = 0.0, cy = 0.0, cz = 0.0;
+		for (last = first; last < n; ++last) {
+			auto const& other = stars[order[last]];
+			if (healpixIndex(other.rightAscension, other.declination, CELL_HEALPIX_ORDER) != cell) {
+				break;
+			}
+			cx += x[last];
+			cy += y[last];
+			cz += z[last];
+		}
+		auto const norm = std::sqrt(cx*cx + cy*cy + cz*cz);
+		if (norm > 0.0) {
+			cx /= norm;
+			cy /= norm;
+			cz /= norm;
+		} else {
+			cx = 1.0;
+		}
+		auto minCos = 1.0;
+		for (auto i = first; i < last; ++i) {
+			minCos = std::min(minCos, cx*x[i] + cy*y[i] + cz*z[i]);
+		}
+		// A little slack, so float rounding never drops a star.
+		auto const sinRadius = minCos <= 0.0 ? 2.0 :
+		    std::min(1.0, std::sqrt(1.0 - minCos*minCos) + 1e-5);
+		appendf(out, "%s\n	{ %.9g, %.9g, %.9g, %.9g, %.9g, %zu, %zu }",
+			numCells++ ? "," : "", cx, cy, cz, sinRadius, star.magnitude, first, last - first);
+	}
+	if (numCells == 0) {
+		out->append("\n	{ 1, 0, 0, 2, 0, 0, 0 }");	// C has no empty arrays
+	}
+	out->append("\n};\n\n");
+
+	double const* const axes[] = { x.data(), y.data(), z.data() };
+	for (auto axis = 0; axis < 3; ++axis) {
+		appendf(out, "static const float %s_%c[] = {", var.c_str(), "xyz"[axis]);
+		for (size_t i = 0; i < n; ++i) {
+			appendf(out, "%s%.9g", i % 8 ? ", " : i ? ",\n	" : "\n	", axes[axis][i]);
+		}
+		if (n == 0) {
+			out->append("\n	0");
+		}
+		out->append("\n};\n\n");
+	}
+
+	appendf(out,
+		"unsigned\n"
+		"%s_cull(const float forward[3], const float up[3], float fovY,\n"
+		"    float aspect, float maxMagnitude, unsigned *indices, unsigned max)\n"
+		"{\n"
+		"	float right[3], top[3], planes[4][3];\n"
+		"	float tanY, tanX, length;\n"
+		"	unsigned written = 0, cell, first, end, i, j, k;\n"
+		"\n"
+		"	right[0] = forward[1]*up[2] - forward[2]*up[1];\n"
+		"	right[1] = forward[2]*up[0] - forward[0]*up[2];\n"
+		"	right[2] = forward[0]*up[1] - forward[1]*up[0];\n"
+		"	top[0] = right[1]*forward[2] - right[2]*forward[1];\n"
+		"	top[1] = right[2]*forward[0] - right[0]*forward[2];\n"
+		"	top[2] = right[0]*forward[1] - right[1]*forward[0];\n"
+		"	tanY = (float)tan(fovY/2.0f);\n"
+		"	tanX = tanY*aspect;\n"
+		"	for (k = 0; k < 3; ++k) {\n"
+		"		planes[0][k] = forward[k]*tanX + right[k];\n"
+		"		planes[1][k] = forward[k]*tanX - right[k];\n"
+		"		planes[2][k] = forward[k]*tanY + top[k];\n"
+		"		planes[3][k] = forward[k]*tanY - top[k];\n"
+		"	}\n"
+		"	for (j = 0; j < 4; ++j) {\n"
+		"		length = (float)sqrt(planes[j][0]*planes[j][0] + planes[j][1]*planes[j][1] +\n"
+		"		    planes[j][2]*planes[j][2]);\n"
+		"		for (k = 0; k < 3; ++k) {\n"
+		"			planes[j][k] /= length;\n"
+		"		}\n"
+		"	}\n"
+		"\n",
+		var.c_str());
+	appendf(out,
+		"	for (cell = 0; cell < sizeof %s_cells/sizeof %s_cells[0]; ++cell) {\n"
+		"		int inside = 1;\n"
+		"		if (%s_cells[cell].brightest > maxMagnitude) {\n"
+		"			continue;\n"
+		"		}\n"
+		"		for (j = 0; j < 4; ++j) {\n"
+		"			float const d = planes[j][0]*%s_cells[cell].x +\n"
+		"			    planes[j][1]*%s_cells[cell].y + planes[j][2]*%s_cells[cell].z;\n"
+		"			if (d < -%s_cells[cell].sinRadius) {\n"
+		"				break;\n"
+		"			}\n"
+		"			inside &= d >= %s_cells[cell].sinRadius;\n"
+		"		}\n"
+		"		if (j < 4) {\n"
+		"			continue;\n"
+		"		}\n"
+		"		first = %s_cells[cell].first;\n"
+		"		for (end = first; end < first + %s_cells[cell].count &&\n"
+		"		    %s_stars[end].magnitude <= maxMagnitude; ++end) {\n"
+		"		}\n",
+		var.c_str(), var.c_str(), var.c_str(), var.c_str(), var.c_str(),
+		var.c_str(), var.c_str(), var.c_str(), var.c_str(), var.c_str(), var.c_str());
+	appendf(out,
+		"		for (i = first; i < end; i += 64) {\n"
+		"			unsigned char visible[64];\n"
+		"			unsigned const count = end - i < 64 ? end - i : 64;\n"
+		"			for (j = 0; j < count; ++j) {\n"
+		"				float const x = %s_x[i + j], y = %s_y[i + j], z = %s_z[i + j];\n"
+		"				visible[j] = (unsigned char)(inside |\n"
+		"				    ((planes[0][0]*x + planes[0][1]*y + planes[0][2]*z >= 0.0f) &\n"
+		"				     (planes[1][0]*x + planes[1][1]*y + planes[1][2]*z >= 0.0f) &\n"
+		"				     (planes[2][0]*x + planes[2][1]*y + planes[2][2]*z >= 0.0f) &\n"
+		"				     (planes[3][0]*x + planes[3][1]*y + planes[3][2]*z >= 0.0f)));\n"
+		"			}\n"
+		"			for (j = 0; j < count; ++j) {\n"
+		"				if (visible[j]) {\n"
+		"					if (written == max) {\n"
+		"						return written;\n"
+		"					}\n"
+		"					indices[written++] = i + j;\n"
+		"				}\n"
+		"			}\n"
+		"		}\n"
+		"	}\n"
+		"	return written;\n"
+		"}\n\n",
+		var.c_str(), var.c_str(), var.c_str());
+}
+
+/*
+ * --lod: a hierarchy of levels, level L holding HEALPix cells of order L.
+ * Going from the brightest star down, each level takes up to K of the
+ * stars left in each of its cells and sums the rest of each cell into
+ * one aggregate entry, at the flux weighted mean position and with the
+ * magnitude of the summed flux.  Drawing levels 0 to L and the aggregates
+ * of level L then shows the flux of the whole sky with at most K stars
+ * per cell and level.  The last level takes all that is left.  Entries
+ * are ordered by level, cell, and magnitude, the aggregate last.
+ */
+static int const LOD_MAX_LEVEL = HEALPIX_ORDER;
+
+struct Aggregate {
+	double x, y, z;		// flux weighted sum of unit vectors
+	double flux[MAX_MAGNITUDES];
+	std::uint32_t count;
+};
+
+static
+double
+fluxOf(float const magnitude)
+{
+	return std::pow(10.0, -0.4*magnitude);
+}
+
+static
+void
+buildLevels(
+    std::vector<Star>* levels,
+    std::vector<Star> const& stars,
+    std::vector<std::uint32_t> const& order,
+    Header const& header,
+    int const k)
+{
+	std::vector<std::uint64_t> cells(stars.size());
+	for (size_t i = 0; i < stars.size(); ++i) {
+		cells[i] = healpixIndex(stars[i].rightAscension, stars[i].declination, HEALPIX_ORDER);
+	}
+
+	levels->clear();
+	levels->reserve(stars.size());
+	std::vector<std::uint32_t> remaining(order);
+	std::vector<std::uint32_t> left;
+	std::vector<std::pair<std::uint64_t, Star>> entries;
+	std::unordered_map<std::uint64_t, int> taken;
+	std::unordered_map<std::uint64_t, Aggregate> aggregates;
+	for (auto level = 0; !remaining.empty(); ++level) {
+		auto const shift = 2*(HEALPIX_ORDER - level);
+		entries.clear();
+		taken.clear();
+		aggregates.clear();
+		left.clear();
+		for (auto const i : remaining) {
+			auto const cell = cells[i] >> shift;
+			auto const& star = stars[i];
+			if (level == LOD_MAX_LEVEL || taken[cell]++ < k) {
+				entries.push_back(std::make_pair(cell, star));
+				entries.back().second.level = level;
+				continue;
+			}
+			left.push_back(i);
+			auto& aggregate = aggregates[cell];
+			auto const flux = fluxOf(star.magnitude);
+			aggregate.x += flux*std::cos(star.declination)*std::cos(star.rightAscension);
+			aggregate.y += flux*std::cos(star.declination)*std::sin(star.rightAscension);
+			aggregate.z += flux*std::sin(star.declination);
+			for (auto band = 0; band < header.numMagnitudes; ++band) {
+				aggregate.flux[band] += fluxOf(star.magnitudes[band]);
+			}
+			++aggregate.count;
+		}
+		auto const numStars = entries.size();
+		for (auto const& item : aggregates) {
+			auto const& aggregate = item.second;
+			Star star;
+			std::memset(&star, 0, sizeof star);
+			star.name = "";
+			std::strcpy(star.spectralType, "--");	// printable, as it is output
+			star.rightAscension = std::atan2(aggregate.y, aggregate.x);
+			if (star.rightAscension < 0.0) {
+				star.rightAscension += 2.0*M_PI;
+			}
+			star.declination = std::atan2(aggregate.z, std::hypot(aggregate.x, aggregate.y));
+			for (auto band = 0; band < header.numMagnitudes; ++band) {
+				star.magnitudes[band] = (float)(-2.5*std::log10(aggregate.flux[band]));
+			}
+			star.magnitude = star.magnitudes[header.apparentMagnitude];
+			star.level = level;
+			star.aggregated = aggregate.count;
+			entries.push_back(std::make_pair(item.first, star));
+		}
+		// Aggregates come in hash order; put them in cell order before
+		// the stable sort places each after the stars of its cell.
+		std::sort(entries.begin() + numStars, entries.end(),
+			  [](std::pair<std::uint64_t, Star> const& a, std::pair<std::uint64_t, Star> const& b) {
+			return a.first < b.first;
+		});
+		std::stable_sort(entries.begin(), entries.end(),
+				 [](std::pair<std::uint64_t, Star> const& a, std::pair<std::uint64_t, Star> const& b) {
+			return a.first < b.first;
+		});
+		for (auto const& entry : entries) {
+			levels->push_back(entry.second);
+		}
+		remaining.swap(left);
+	}
+}
+
+/*
+ * --tiles: a pyramid of sky tiles in one file, for clients that fetch
+ * only the tiles in view.  Level L is made of the 12*4^L HEALPix cells of
+ * order L, and each of its tiles holds every star in the cell brighter
+ * than the level's limit, brightest first.  Everything is little-endian:
+ *
+ *   "SIDUSTL1", u32 number of levels, u32 record size, u32 epoch
+ *     (0 J2000, 1 B1950), u32 reserved
+ *   per level: f32 limit, u32 number of tiles, u64 offset of its index
+ *   per level index, per tile in nested order: u64 offset, u32 count,
+ *     u32 reserved
+ *   records: f64 ra, f64 dec (radians), f32 magnitude, 2 characters
+ *     spectral type, 2 reserved bytes
+ */
+static int const TILE_RECORD_SIZE = 24;
+static int const TILE_MAX_LEVELS = 10;
+
+static
+void
+appendLittleEndian(std::string* out, std::uint64_t const value, int const size)
+{
+	for (auto i = 0; i < size; ++i) {
+		out->push_back((char)(value >> (8*i)));
+	}
+}
+
+static
+void
+appendLittleEndian(std::string* out, double const value)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	appendLittleEndian(out, bits, 8);
+}
+
+static
+void
+appendLittleEndian(std::string* out, float const value)
+{
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	appendLittleEndian(out, bits, 4);
+}
+
+// A byte count with an optional K, M or G suffix.
+static
+int
+parseSize(size_t* size, char const* const text)
+{
+	char* rest = nullptr;
+	auto value = std::strtoull(text, &rest, 10);
+	if (rest == text || *text == '-') {
+		return -1;
+	}
+	switch (*rest) {
+	case 'G':
+		value <<= 10;
+		// fall through
+	case 'M':
+		value <<= 10;
+		// fall through
+	case 'K':
+		value <<= 10;
+		++rest;
+		break;
+	default:
+		break;
+	}
+	if (*rest || value == 0) {
+		return -1;
+	}
+	*size = value;
+	return 0;
+}
+
+static
+int
+parseTileLimits(std::vector<float>* limits, std::string const& spec)
+{
+	limits->clear();
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		auto end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		auto const item = spec.substr(begin, end - begin);
+		char* rest = nullptr;
+		auto const limit = std::strtod(item.c_str(), &rest);
+		if (item.empty() || *rest || limits->size() == (size_t)TILE_MAX_LEVELS) {
+			std::fprintf(stderr, "sidus: invalid tile limit '%s'\n", item.c_str());
+			return -1;
+		}
+		limits->push_back((float)limit);
+		begin = end + 1;
+	}
+	return 0;
+}
+
+// The file header and the index of tiles with counts[level][tile] stars.
+static
+void
+appendTileHeader(
+    std::string* head,
+    std::vector<float> const& limits,
+    Epoch const epoch,
+    std::vector<std::vector<std::uint32_t>> const& counts)
+{
+	auto const numLevels = (int)limits.size();
+	head->append("SIDUSTL1");
+	appendLittleEndian(head, numLevels, 4);
+	appendLittleEndian(head, TILE_RECORD_SIZE, 4);
+	appendLittleEndian(head, epoch == Epoch::B1950 ? 1 : 0, 4);
+	appendLittleEndian(head, 0, 4);
+	std::uint64_t offset = head->size() + 16*numLevels;
+	for (auto level = 0; level < numLevels; ++level) {
+		auto const numTiles = (std::uint64_t)12 << (2*level);
+		appendLittleEndian(head, limits[level]);
+		appendLittleEndian(head, numTiles, 4);
+		appendLittleEndian(head, offset, 8);
+		offset += 16*numTiles;
+	}
+	for (auto level = 0; level < numLevels; ++level) {
+		for (auto const count : counts[level]) {
+			appendLittleEndian(head, offset, 8);
+			appendLittleEndian(head, count, 4);
+			appendLittleEndian(head, 0, 4);
+			offset += (std::uint64_t)count*TILE_RECORD_SIZE;
+		}
+	}
+}
+
+static
+void
+appendTileRecord(
+    std::string* out,
+    double const rightAscension,
+    double const declination,
+    float const magnitude,
+    char const* const spectralType)
+{
+	appendLittleEndian(out, rightAscension);
+	appendLittleEndian(out, declination);
+	appendLittleEndian(out, magnitude);
+	out->append(spectralType, 2);
+	out->append(2, '\0');
+}
+
+static
+int
+writeTiles(
+    char const* const path,
+    std::vector<Star> const& stars,
+    std::vector<std::uint32_t> const& order,
+    std::vector<float> const& limits,
+    Epoch const epoch)
+{
+	std::vector<std::uint64_t> cells(stars.size());
+	for (size_t i = 0; i < stars.size(); ++i) {
+		cells[i] = healpixIndex(stars[i].rightAscension, stars[i].declination, HEALPIX_ORDER);
+	}
+
+	// The stars of each level, in tile order and brightest first within
+	// a tile, as indices into stars.
+	auto const numLevels = (int)limits.size();
+	std::vector<std::vector<std::uint32_t>> levels(numLevels);
+	for (auto level = 0; level < numLevels; ++level) {
+		auto& members = levels[level];
+		for (auto const i : order) {
+			if (stars[i].magnitude >= limits[level]) {
+				break;
+			}
+			members.push_back(i);
+		}
+		auto const shift = 2*(HEALPIX_ORDER - level);
+		std::stable_sort(members.begin(), members.end(), [&](std::uint32_t a, std::uint32_t b) {
+			return (cells[a] >> shift) < (cells[b] >> shift);
+		});
+	}
+
+	std::vector<std::vector<std::uint32_t>> counts(numLevels);
+	for (auto level = 0; level < numLevels; ++level) {
+		auto const shift = 2*(HEALPIX_ORDER - level);
+		counts[level].assign((size_t)12 << (2*level), 0);
+		for (auto const i : levels[level]) {
+			++counts[level][cells[i] >> shift];
+		}
+	}
+	std::string head;
+	appendTileHeader(&head, limits, epoch, counts);
+
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", path);
+		return -1;
+	}
+	std::unique_ptr<FILE, int (*)(FILE*)> file(f, fclose);
+	auto ok = std::fwrite(head.data(), 1, head.size(), f) == head.size();
+	std::string records;
+	for (auto const& members : levels) {
+		for (auto const i : members) {
+			auto const& star = stars[i];
+			appendTileRecord(&records, star.rightAscension, star.declination, star.magnitude,
+					 star.spectralType);
+			if (records.size() >= (1 << 20)) {
+				ok = ok && std::fwrite(records.data(), 1, records.size(), f) == records.size();
+				records.clear();
+			}
+		}
+	}
+	ok = ok && std::fwrite(records.data(), 1, records.size(), f) == records.size();
+	if (!ok || fclose(file.release()) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to write file\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Byte offsets of the fields within a star record.
+ */
+struct Layout {
+	int id;
+	int rightAscension;
+	int declination;
+	int spectralType;
+	int magnitudes;
+	int magnitude;		// of the apparent magnitude in use
+	int properMotion;
+	int name;
+	int size;
+};
+
+static
+Layout
+recordLayout(Header const& header)
+{
+	Layout layout;
+	layout.id = 0;
+	layout.rightAscension = header.starId != Header::NO_STAR_ID ? 4 : 0;
+	layout.declination = layout.rightAscension + 8;
+	layout.spectralType = layout.declination + 8;
+	layout.magnitudes = layout.spectralType + 2;
+	layout.magnitude = layout.magnitudes + 2*header.apparentMagnitude;
+	layout.properMotion = layout.spectralType + 2 + 2*header.numMagnitudes;
+	layout.name = layout.properMotion;
+	if (header.properMotion == Header::PROPER_MOTION) {
+		layout.name += 4 + 4;
+	}
+	else if (header.properMotion == Header::RADIAL_VELOCITY) {
+		layout.name += 8;
+	}
+	layout.size = layout.name + header.starNameLength;
+	return layout;
+}
+
+/*
+ * A chunk of stars decoded column by column.  Only the columns a filter
+ * refers to are filled in, and only for the records listed in rows, if
+ * given.
+ */
+enum Column {
+	COLUMN_MAG = 1 << 0,
+	COLUMN_RA = 1 << 1,
+	COLUMN_DEC = 1 << 2,
+	COLUMN_ID = 1 << 3,
+	COLUMN_PMRA = 1 << 4,
+	COLUMN_PMDEC = 1 << 5,
+	COLUMN_RV = 1 << 6,
+	COLUMN_SPECTRAL = 1 << 7,
+	COLUMN_NAME = 1 << 8,
+	COLUMN_BANDS = 1 << 9
+};
+
+struct StarTable {
+	int count;
+	PageVector<float> magnitude;
+	PageVector<float> magnitudes[MAX_MAGNITUDES];	// for the bands asked for
+	PageVector<double> rightAscension;
+	PageVector<double> declination;
+	PageVector<double> starId;
+	PageVector<float> properMotionRA;
+	PageVector<float> properMotionDec;
+	PageVector<double> radialVelocity;
+	PageVector<char> spectralType;	// two characters per star
+	PageVector<char> name;		// starNameLength + 1 characters per star
+};
+
+// Sizes the columns for count rows, leaving them to decodeColumnRange().
+static
+void
+sizeColumns(
+    StarTable* table,
+    Header const& header,
+    int const count,
+    unsigned const columns,
+    unsigned const bands)
+{
+	table->count = count;
+	if (columns & COLUMN_MAG) {
+		table->magnitude.resize(count);
+	}
+	for (auto band = 0; band < header.numMagnitudes; ++band) {
+		if ((columns & COLUMN_BANDS) && ((bands >> band) & 1)) {
+			table->magnitudes[band].resize(count);
+		}
+	}
+	if (columns & COLUMN_RA) {
+		table->rightAscension.resize(count);
+	}
+	if (columns & COLUMN_DEC) {
+		table->declination.resize(count);
+	}
+	if (columns & COLUMN_ID) {
+		table->starId.resize(count);
+	}
+	if (columns & (COLUMN_PMRA | COLUMN_PMDEC)) {
+		table->properMotionRA.resize(count);
+		table->properMotionDec.resize(count);
+	}
+	if (columns & COLUMN_RV) {
+		table->radialVelocity.resize(count);
+	}
+	if (columns & COLUMN_SPECTRAL) {
+		table->spectralType.resize(2*count);
+	}
+	if (columns & COLUMN_NAME) {
+		table->name.resize((size_t)(header.starNameLength + 1)*count);
+	}
+}
+
+// Decodes the rows [begin, end) of columns already sized.
+static
+void
+decodeColumnRange(
+    StarTable* table,
+    Header const& header,
+    Layout const& layout,
+    unsigned char const* const data,
+    std::uint32_t const* const rows,
+    int const begin,
+    int const end,
+    unsigned const columns,
+    unsigned const bands)
+{
+	auto const le = header.littleEndian;
+	auto const stride = (size_t)header.numBytesPerStar;
+	auto record = [&](int const i) {
+		return data + (rows ? rows[i] : i)*stride;
+	};
+	if (columns & COLUMN_MAG) {
+		for (auto i = begin; i < end; ++i) {
+			std::int16_t mag;
+			parse(&mag, record(i) + layout.magnitude, le);
+			table->magnitude[i] = (float)(mag)/100.0f;
+		}
+	}
+	for (auto band = 0; band < header.numMagnitudes; ++band) {
+		if ((columns & COLUMN_BANDS) && ((bands >> band) & 1)) {
+			for (auto i = begin; i < end; ++i) {
+				std::int16_t mag;
+				parse(&mag, record(i) + layout.magnitudes + 2*band, le);
+				table->magnitudes[band][i] = (float)(mag)/100.0f;
+			}
+		}
+	}
+	if (columns & COLUMN_RA) {
+		for (auto i = begin; i < end; ++i) {
+			parse(&table->rightAscension[i], record(i) + layout.rightAscension, le);
+		}
+	}
+	if (columns & COLUMN_DEC) {
+		for (auto i = begin; i < end; ++i) {
+			parse(&table->declination[i], record(i) + layout.declination, le);
+		}
+	}
+	if (columns & COLUMN_ID) {
+		for (auto i = begin; i < end; ++i) {
+			if (header.starId == Header::INTEGER_STAR_ID) {
+				std::int32_t xno;
+				parse(&xno, record(i) + layout.id, le);
+				table->starId[i] = xno;
+			}
+			else if (header.starId != Header::NO_STAR_ID) {
+				float xno;
+				parse(&xno, record(i) + layout.id, le);
+				table->starId[i] = xno;
+			} else {
+				table->starId[i] = 0.0;
+			}
+		}
+	}
+	if (columns & (COLUMN_PMRA | COLUMN_PMDEC)) {
+		for (auto i = begin; i < end; ++i) {
+			if (header.properMotion == Header::PROPER_MOTION) {
+				parse(&table->properMotionRA[i], record(i) + layout.properMotion, le);
+				parse(&table->properMotionDec[i], record(i) + layout.properMotion + 4, le);
+			} else {
+				table->properMotionRA[i] = 0.0f;
+				table->properMotionDec[i] = 0.0f;
+			}
+		}
+	}
+	if (columns & COLUMN_RV) {
+		for (auto i = begin; i < end; ++i) {
+			if (header.properMotion == Header::RADIAL_VELOCITY) {
+				parse(&table->radialVelocity[i], record(i) + layout.properMotion, le);
+			} else {
+				table->radialVelocity[i] = 0.0;
+			}
+		}
+	}
+	if (columns & COLUMN_SPECTRAL) {
+		for (auto i = begin; i < end; ++i) {
+			table->spectralType[2*i + 0] = record(i)[layout.spectralType + 0];
+			table->spectralType[2*i + 1] = record(i)[layout.spectralType + 1];
+		}
+	}
+	if (columns & COLUMN_NAME) {
+		auto const length = header.starNameLength;
+		for (auto i = begin; i < end; ++i) {
+			auto name = &table->name[(size_t)i*(length + 1)];
+			std::strncpy(name, (char const*)(record(i) + layout.name), length);
+			name[length] = '\0';
+		}
+	}
+}
+
+static
+void
+decodeColumns(
+    StarTable* table,
+    Header const& header,
+    Layout const& layout,
+    unsigned char const* const data,
+    std::uint32_t const* const rows,
+    int const count,
+    unsigned const columns,
+    unsigned const bands)
+{
+	sizeColumns(table, header, count, columns, bands);
+	decodeColumnRange(table, header, layout, data, rows, 0, count, columns, bands);
+}
+
+static int const COLUMN_RANGE_STARS = 1 << 16;
+
+/*
+ * Decodes a whole catalog a range of rows per task, each range first
+ * prepared by prepare(begin, end), e.g. read in, on the same thread.
+ * With --numa both the records and the columns of a range are then
+ * first touched on the node of the worker that decoded them.
+ */
+template <typename Prepare>
+static
+int
+decodeAllColumns(
+    StarTable* table,
+    Header const& header,
+    Layout const& layout,
+    unsigned char const* const data,
+    int const count,
+    unsigned const columns,
+    unsigned const bands,
+    Prepare prepare)
+{
+	sizeColumns(table, header, count, columns, bands);
+	std::atomic<bool> failed(false);
+	pool.parallelFor((size_t)(count + COLUMN_RANGE_STARS - 1)/COLUMN_RANGE_STARS, [&](size_t const range) {
+		auto const begin = (int)range*COLUMN_RANGE_STARS;
+		auto const end = std::min(count, begin + COLUMN_RANGE_STARS);
+		if (prepare(begin, end) != 0) {
+			failed = true;
+			return;
+		}
+		PhaseTimer timer(PHASE_DECODE, (size_t)(end - begin)*header.numBytesPerStar, end - begin);
+		decodeColumnRange(table, header, layout, data, nullptr, begin, end, columns, bands);
+	});
+	return failed ? -1 : 0;
+}
+
+/*
+ * Filter expressions, e.g. 'mag < 6 && dec > -0.5 && spectral ~ "B*"',
+ * are compiled once into a postfix program.  The program is run over a
+ * whole StarTable at a time, each step producing a bit mask with one bit
+ * per star, so the inner loops are tight passes over a single column.
+ *
+ *   expr    := and { "||" and }
+ *   and     := unary { "&&" unary }
+ *   unary   := "!" unary | "(" expr ")" | field op value
+ *   field   := mag | ra | dec | id | pmra | pmdec | rv | spectral | name |
+ *              mag<n> | mag<n> - mag<m>
+ *   op      := < | <= | > | >= | == | != | ~
+ *
+ * mag is the apparent magnitude in use, mag<n> any other one and
+ * mag<n> - mag<m> a color index such as B-V.  Angles are in radians.
+ * spectral and name compare against quoted strings, where ~ matches a
+ * glob pattern using * and ?.
+ */
+struct FilterOp {
+	enum Kind { COMPARE, VALID, AND, OR, NOT } kind = COMPARE;
+	unsigned column = 0;
+	int band = -1;
+	int band2 = -1;	// subtracted from band, if not negative
+	enum Compare { LT, LE, GT, GE, EQ, NE, MATCH } compare = LT;
+	double value = 0.0;
+	std::string pattern;
+	std::vector<std::uint64_t> spectralTypes;	// 65536 bit set of matching types
+};
+
+struct Filter {
+	std::vector<FilterOp> program;
+	unsigned columns;
+	unsigned bands;
+	int depth;
+};
+
+static
+bool
+globMatch(char const* pattern, char const* s)
+{
+	for (; *pattern; ++pattern, ++s) {
+		if (*pattern == '*') {
+			for (;; ++s) {
+				if (globMatch(pattern + 1, s)) {
+					return true;
+				}
+				if (!*s) {
+					return false;
+				}
+			}
+		}
+		if (!*s || (*pattern != '?' && *pattern != *s)) {
+			return false;
+		}
+	}
+	return !*s;
+}
+
+class FilterParser {
+public:
+	FilterParser(Filter* filter, std::string const& text, std::string* message)
+	    : filter(filter), text(text), pos(0), error(false), message(message)
+	{
+	}
+
+	int
+	parse()
+	{
+		expr();
+		skipSpace();
+		if (!error && pos != text.size()) {
+			fail("unexpected input");
+		}
+		return error ? -1 : 0;
+	}
+
+private:
+	Filter* filter;
+	std::string const& text;
+	size_t pos;
+	bool error;
+	std::string* message;	// for the error instead of stderr, if set
+
+	void
+	fail(char const* const what)
+	{
+		if (!error && message) {
+			message->clear();
+			appendf(message, "filter: %s at offset %zu", what, pos);
+		}
+		else if (!error) {
+			std::fprintf(stderr, "sidus: filter: %s at offset %zu\n", what, pos);
+		}
+		error = true;
+	}
+
+	void
+	skipSpace()
+	{
+		while (pos < text.size() && std::isspace((unsigned char)text[pos])) {
+			++pos;
+		}
+	}
+
+	bool
+	accept(char const* const token)
+	{
+		skipSpace();
+		auto const n = std::strlen(token);
+		if (text.compare(pos, n, token) == 0) {
+			pos += n;
+			return true;
+		}
+		return false;
+	}
+
+	void
+	emit(FilterOp::Kind const kind)
+	{
+		FilterOp op;
+		op.kind = kind;
+		filter->program.push_back(op);
+	}
+
+	void
+	expr()
+	{
+		conjunction();
+		while (!error && accept("||")) {
+			conjunction();
+			emit(FilterOp::OR);
+		}
+	}
+
+	void
+	conjunction()
+	{
+		unary();
+		while (!error && accept("&&")) {
+			unary();
+			emit(FilterOp::AND);
+		}
+	}
+
+	void
+	unary()
+	{
+		if (accept("!")) {
+			unary();
+			emit(FilterOp::NOT);
+		}
+		else if (accept("(")) {
+			expr();
+			if (!accept(")")) {
+				fail("expected ')'");
+			}
+		} else {
+			comparison();
+		}
+	}
+
+	void
+	comparison()
+	{
+		skipSpace();
+		auto const begin = pos;
+		auto const field = name();
+
+		FilterOp op;
+		op.kind = FilterOp::COMPARE;
+		op.value = 0.0;
+		op.band = -1;
+		op.band2 = -1;
+		if (band(&op.band, field)) {
+			op.column = COLUMN_BANDS;
+			if (accept("-")) {
+				skipSpace();
+				if (!band(&op.band2, name())) {
+					fail("expected magnitude band");
+					return;
+				}
+			}
+		}
+		else if (field == "mag") {
+			op.column = COLUMN_MAG;
+		}
+		else if (field == "ra") {
+			op.column = COLUMN_RA;
+		}
+		else if (field == "dec") {
+			op.column = COLUMN_DEC;
+		}
+		else if (field == "id") {
+			op.column = COLUMN_ID;
+		}
+		else if (field == "pmra") {
+			op.column = COLUMN_PMRA;
+		}
+		else if (field == "pmdec") {
+			op.column = COLUMN_PMDEC;
+		}
+		else if (field == "rv") {
+			op.column = COLUMN_RV;
+		}
+		else if (field == "spectral") {
+			op.column = COLUMN_SPECTRAL;
+		}
+		else if (field == "name") {
+			op.column = COLUMN_NAME;
+		} else {
+			pos = begin;
+			fail("expected field name");
+			return;
+		}
+
+		if (accept("<=")) {
+			op.compare = FilterOp::LE;
+		}
+		else if (accept(">=")) {
+			op.compare = FilterOp::GE;
+		}
+		else if (accept("==")) {
+			op.compare = FilterOp::EQ;
+		}
+		else if (accept("!=")) {
+			op.compare = FilterOp::NE;
+		}
+		else if (accept("<")) {
+			op.compare = FilterOp::LT;
+		}
+		else if (accept(">")) {
+			op.compare = FilterOp::GT;
+		}
+		else if (accept("~")) {
+			op.compare = FilterOp::MATCH;
+		} else {
+			fail("expected comparison operator");
+			return;
+		}
+
+		auto const textual = op.column == COLUMN_SPECTRAL || op.column == COLUMN_NAME;
+		skipSpace();
+		if (textual) {
+			if (pos >= text.size() || text[pos] != '"') {
+				fail("expected quoted string");
+				return;
+			}
+			auto const end = text.find('"', pos + 1);
+			if (end == std::string::npos) {
+				fail("unterminated string");
+				return;
+			}
+			op.pattern = text.substr(pos + 1, end - pos - 1);
+			pos = end + 1;
+			if (op.compare != FilterOp::EQ &&
+			    op.compare != FilterOp::NE &&
+			    op.compare != FilterOp::MATCH) {
+				fail("strings only compare with ==, != and ~");
+				return;
+			}
+		} else {
+			if (op.compare == FilterOp::MATCH) {
+				fail("~ only applies to spectral and name");
+				return;
+			}
+			char* end = nullptr;
+			op.value = std::strtod(text.c_str() + pos, &end);
+			if (end == text.c_str() + pos) {
+				fail("expected number");
+				return;
+			}
+			pos = end - text.c_str();
+		}
+
+		if (op.column == COLUMN_SPECTRAL) {
+			// Two characters make for few enough types to decide them
+			// all up front.
+			op.spectralTypes.assign(65536/64, 0);
+			for (auto t = 0; t < 65536; ++t) {
+				char const type[3] = { (char)(t >> 8), (char)(t & 0xff), '\0' };
+				auto const match = op.compare == FilterOp::MATCH ?
+				    globMatch(op.pattern.c_str(), type) :
+				    (op.pattern == std::string(type, 2)) == (op.compare == FilterOp::EQ);
+				if (match) {
+					op.spectralTypes[t/64] |= (std::uint64_t)1 << (t%64);
+				}
+			}
+		}
+
+		filter->columns |= op.column;
+		if (op.column == COLUMN_BANDS) {
+			filter->bands |= 1u << op.band;
+			if (op.band2 >= 0) {
+				filter->bands |= 1u << op.band2;
+			}
+		}
+		filter->program.push_back(op);
+	}
+
+	std::string
+	name()
+	{
+		auto const begin = pos;
+		while (pos < text.size() && std::isalnum((unsigned char)text[pos])) {
+			++pos;
+		}
+		return text.substr(begin, pos - begin);
+	}
+
+	bool
+	band(int* band, std::string const& field)
+	{
+		if (field.size() != 4 || field.compare(0, 3, "mag") != 0 ||
+		    !std::isdigit((unsigned char)field[3])) {
+			return false;
+		}
+		*band = field[3] - '0';
+		return true;
+	}
+};
+
+/*
+ * The program always ends by dropping "invalid" entries and applying the
+ * -f magnitude limit, if any.  Errors go to stderr, or into message if
+ * one is given.
+ */
+static
+int
+compileFilter(
+    Filter* filter,
+    std::string const& text,
+    double const filterMagnitude,
+    std::string* message = nullptr)
+{
+	filter->program.clear();
+	filter->columns = COLUMN_MAG | COLUMN_RA | COLUMN_DEC;
+	filter->bands = 0;
+
+	FilterOp valid;
+	valid.kind = FilterOp::VALID;
+	filter->program.push_back(valid);
+
+	if (!text.empty()) {
+		FilterParser parser(filter, text, message);
+		if (parser.parse() != 0) {
+			return -1;
+		}
+		FilterOp op;
+		op.kind = FilterOp::AND;
+		filter->program.push_back(op);
+	}
+
+	if (filterMagnitude != DBL_MAX) {
+		FilterOp limit;
+		limit.kind = FilterOp::COMPARE;
+		limit.column = COLUMN_MAG;
+		limit.compare = FilterOp::LE;
+		limit.value = filterMagnitude;
+		filter->program.push_back(limit);
+		FilterOp op;
+		op.kind = FilterOp::AND;
+		filter->program.push_back(op);
+	}
+
+	auto depth = 0;
+	filter->depth = 0;
+	for (auto const& op : filter->program) {
+		depth += op.kind == FilterOp::COMPARE || op.kind == FilterOp::VALID ? 1 :
+		    op.kind == FilterOp::NOT ? 0 : -1;
+		filter->depth = std::max(filter->depth, depth);
+	}
+	assert(depth == 1);
+	return 0;
+}
+
+/*
+ * Returns where the operand of the filter program ending at end starts.
+ */
+static
+size_t
+filterStart(std::vector<FilterOp> const& program, size_t const end)
+{
+	switch (program[end - 1].kind) {
+	case FilterOp::NOT:
+		return filterStart(program, end - 1);
+	case FilterOp::AND:
+	case FilterOp::OR:
+		return filterStart(program, filterStart(program, end - 1));
+	default:
+		return end - 1;
+	}
+}
+
+template <typename T, typename Predicate>
+static
+void
+maskColumn(std::uint64_t* mask, T const* const column, int const count, Predicate predicate)
+{
+	for (auto base = 0; base < count; base += 64) {
+		auto const n = std::min(64, count - base);
+		std::uint64_t word = 0;
+		for (auto j = 0; j < n; ++j) {
+			word |= (std::uint64_t)predicate(column[base + j]) << j;
+		}
+		mask[base/64] = word;
+	}
+}
+
+template <typename T>
+static
+void
+maskCompare(std::uint64_t* mask, T const* const column, int const count, FilterOp const& op)
+{
+	auto const v = op.value;
+	switch (op.compare) {
+	case FilterOp::LT:
+		maskColumn(mask, column, count, [v](T x) { return x < v; });
+		break;
+	case FilterOp::LE:
+		maskColumn(mask, column, count, [v](T x) { return x <= v; });
+		break;
+	case FilterOp::GT:
+		maskColumn(mask, column, count, [v](T x) { return x > v; });
+		break;
+	case FilterOp::GE:
+		maskColumn(mask, column, count, [v](T x) { return x >= v; });
+		break;
+	case FilterOp::EQ:
+		maskColumn(mask, column, count, [v](T x) { return x == v; });
+		break;
+	case FilterOp::NE:
+		maskColumn(mask, column, count, [v](T x) { return x != v; });
+		break;
+	case FilterOp::MATCH:
+		assert(false);
+		break;
+	}
+}
+
+/*
+ * Leaves one bit per star in mask, set for those passing the filter.
+ * stack is scratch space and is kept between calls to avoid allocating.
+ */
+static
+void
+evaluateFilter(
+    std::vector<std::uint64_t>* mask,
+    std::vector<std::uint64_t>* stack,
+    Filter const& filter,
+    StarTable const& table,
+    int const nameLength)
+{
+	auto const count = table.count;
+	auto const words = (size_t)(count + 63)/64;
+	stack->resize(words*filter.depth);
+	auto top = stack->data();
+
+	for (auto const& op : filter.program) {
+		switch (op.kind) {
+		case FilterOp::COMPARE:
+			switch (op.column) {
+			case COLUMN_MAG:
+				maskCompare(top, table.magnitude.data(), count, op);
+				break;
+			case COLUMN_RA:
+				maskCompare(top, table.rightAscension.data(), count, op);
+				break;
+			case COLUMN_DEC:
+				maskCompare(top, table.declination.data(), count, op);
+				break;
+			case COLUMN_ID:
+				maskCompare(top, table.starId.data(), count, op);
+				break;
+			case COLUMN_PMRA:
+				maskCompare(top, table.properMotionRA.data(), count, op);
+				break;
+			case COLUMN_PMDEC:
+				maskCompare(top, table.properMotionDec.data(), count, op);
+				break;
+			case COLUMN_RV:
+				maskCompare(top, table.radialVelocity.data(), count, op);
+				break;
+			case COLUMN_BANDS:
+				if (op.band2 < 0) {
+					maskCompare(top, table.magnitudes[op.band].data(), count, op);
+					break;
+				}
+				for (auto base = 0; base < count; base += 64) {
+					auto const n = std::min(64, count - base);
+					float color[64];
+					for (auto j = 0; j < n; ++j) {
+						color[j] = table.magnitudes[op.band][base + j] -
+						    table.magnitudes[op.band2][base + j];
+					}
+					maskCompare(top + base/64, color, n, op);
+				}
+				break;
+			case COLUMN_SPECTRAL:
+				{
+					auto const types = op.spectralTypes.data();
+					auto const chars = (unsigned char const*)table.spectralType.data();
+					for (auto base = 0; base < count; base += 64) {
+						auto const n = std::min(64, count - base);
+						std::uint64_t word = 0;
+						for (auto j = 0; j < n; ++j) {
+							auto const t = (chars[2*(base + j)] << 8) | chars[2*(base + j) + 1];
+							word |= ((types[t/64] >> (t%64)) & 1) << j;
+						}
+						top[base/64] = word;
+					}
+				}
+				break;
+			case COLUMN_NAME:
+				for (auto base = 0; base < count; base += 64) {
+					auto const n = std::min(64, count - base);
+					std::uint64_t word = 0;
+					for (auto j = 0; j < n; ++j) {
+						auto const name = &table.name[(size_t)(base + j)*(nameLength + 1)];
+						auto const match = op.compare == FilterOp::MATCH ?
+						    globMatch(op.pattern.c_str(), name) :
+						    (op.pattern == name) == (op.compare == FilterOp::EQ);
+						word |= (std::uint64_t)match << j;
+					}
+					top[base/64] = word;
+				}
+				break;
+			}
+			top += words;
+			break;
+		case FilterOp::VALID:
+			for (auto base = 0; base < count; base += 64) {
+				auto const n = std::min(64, count - base);
+				std::uint64_t word = 0;
+				for (auto j = 0; j < n; ++j) {
+					auto const invalid =
+					    table.magnitude[base + j] == 0.0f &&
+					    table.rightAscension[base + j] == 0.0 &&
+					    table.declination[base + j] == 0.0;
+					word |= (std::uint64_t)!invalid << j;
+				}
+				top[base/64] = word;
+			}
+			top += words;
+			break;
+		case FilterOp::AND:
+			top -= words;
+			for (size_t w = 0; w < words; ++w) {
+				(top - words)[w] &= top[w];
+			}
+			break;
+		case FilterOp::OR:
+			top -= words;
+			for (size_t w = 0; w < words; ++w) {
+				(top - words)[w] |= top[w];
+			}
+			break;
+		case FilterOp::NOT:
+			for (size_t w = 0; w < words; ++w) {
+				(top - words)[w] = ~(top - words)[w];
+			}
+			break;
+		}
+	}
+
+	mask->assign(stack->begin(), stack->begin() + words);
+	if (count%64) {
+		mask->back() &= ((std::uint64_t)1 << (count%64)) - 1;
+	}
+}
+
+/*
+ * Comma separated lists of magnitude bands, "0,2", and of colors as
+ * differences between two bands, "0-1,1-2".
+ */
+static
+int
+parseBands(std::vector<int>* bands, std::string const& spec)
+{
+	bands->clear();
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		auto end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		auto const item = spec.substr(begin, end - begin);
+		if (item.size() != 1 || !std::isdigit((unsigned char)item[0])) {
+			std::fprintf(stderr, "sidus: invalid magnitude band '%s'\n", item.c_str());
+			return -1;
+		}
+		bands->push_back(item[0] - '0');
+		begin = end + 1;
+	}
+	return 0;
+}
+
+static
+int
+parseColors(std::vector<std::pair<int, int>>* colors, std::string const& spec)
+{
+	colors->clear();
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		auto end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		auto const item = spec.substr(begin, end - begin);
+		if (item.size() != 3 || item[1] != '-' ||
+		    !std::isdigit((unsigned char)item[0]) ||
+		    !std::isdigit((unsigned char)item[2])) {
+			std::fprintf(stderr, "sidus: invalid color '%s'\n", item.c_str());
+			return -1;
+		}
+		colors->push_back(std::make_pair(item[0] - '0', item[2] - '0'));
+		begin = end + 1;
+	}
+	return 0;
+}
+
+/*
+ * Conversion works on chunks of records: the calling thread keeps a
+ * bounded window of them in flight on the pool, where they are decoded,
+ * filtered and formatted, and writes the results out in file order as
+ * they complete, see processChunks.
+ */
+struct Options {
+	double filterMagnitude;
+	std::string filterText;
+	Filter filter;
+	bool spectralFilter;
+	std::uint64_t spectralClasses[4];	// bit set over the first type character
+	std::vector<SortKey> sort;
+	int lod;			// stars per cell and level, 0 for no levels
+	char const* tiles;		// tile pyramid file to write instead of text
+	std::vector<float> tileLimits;	// magnitude limit per tile level
+	Format format;
+	int numThreads;
+	bool numa;			// pin the threads to NUMA nodes
+	size_t maxMemory;		// bytes to sort in before spilling runs, 0 for no limit
+	int shard;			// --shard, counted from 1, of numShards
+	int numShards;			// 0 without --shard
+};
+
+struct Chunk {
+	size_t seq;
+	int first;		// index of the first record in the chunk
+	int count;
+	std::vector<unsigned char> data;
+};
+
+struct Batch {
+	size_t seq;
+	std::vector<Star> stars;
+	std::string text;	// formatted stars, only when output is unsorted
+	Arena names;		// of the stars
+};
+
+static int const CHUNK_STARS = 4096;
+
+/*
+ * Per-worker buffers for decode, kept across chunks so that once they
+ * have grown to a chunk's size nothing is allocated per chunk or star.
+ */
+struct DecodeScratch {
+	std::vector<std::uint32_t> rows;
+	StarTable table;
+	std::vector<std::uint64_t> mask;
+	std::vector<std::uint64_t> stack;
+	Arena names;		// for --watch, which keeps its stars across runs
+};
+
+/*
+ * Reads the records [begin, end) on from where f is in chunks of
+ * CHUNK_STARS, each worked into a Result by a task on the pool, and
+ * hands the results to consume in record order.  A window of chunks is
+ * kept in flight, so that reading overlaps the work on earlier ones.
+ * With the pool pinned to NUMA nodes, each task reads its own chunk, so
+ * that the chunk is first touched on the node it is decoded on.
+ */
+template <typename Result, typename Work, typename Consume>
+static
+int
+processChunks(FILE* f, Header const& header, int const begin, int const end, Work work, Consume consume)
+{
+	auto const numChunks = (size_t)(end - begin + CHUNK_STARS - 1)/CHUNK_STARS;
+	auto const window = 2*(size_t)pool.size();
+	auto const local = pool.isPinned();
+	auto const offset = local ? std::ftell(f) : 0L;
+
+	// A chunk and its result are recycled once consumed, so that past
+	// the first window their buffers are reused rather than allocated
+	// per chunk; work gets a result as the last consumer left it.
+	struct Unit {
+		Chunk chunk;
+		Result result;
+		bool done;
+	};
+	std::vector<std::unique_ptr<Unit>> units;
+	std::vector<Unit*> spare;
+	std::vector<Unit*> inFlight(window);	// by chunk number modulo window
+	std::mutex mutex;
+	std::atomic<bool> failed(false);
+	// Tasks capture no more than this and the unit, which std::function
+	// holds without allocating.
+	auto const run = [&](Unit* const unit) {
+		auto& chunk = unit->chunk;
+		if (local) {
+			auto const size = (size_t)chunk.count*header.numBytesPerStar;
+			chunk.data.resize(size);
+			PhaseTimer timer(PHASE_READ, size, chunk.count);
+			auto const at = offset + (long)(chunk.first - begin)*header.numBytesPerStar;
+			if (readAt(f, at, chunk.data.data(), size) != 0) {
+				failed = true;
+			}
+		}
+		if (!failed) {
+			work(&unit->result, chunk);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		unit->done = true;
+	};
+	TaskGroup group;
+	auto rv = 0;
+	size_t numRead = 0;
+	for (size_t next = 0; next < numRead || (rv == 0 && numRead < numChunks); ++next) {
+		while (rv == 0 && numRead < numChunks && numRead < next + window) {
+			if (spare.empty()) {
+				units.emplace_back(new Unit());
+				spare.push_back(units.back().get());
+			}
+			auto const unit = spare.back();
+			spare.pop_back();
+			auto& chunk = unit->chunk;
+			chunk.seq = numRead;
+			chunk.first = begin + (int)numRead*CHUNK_STARS;
+			chunk.count = std::min(CHUNK_STARS, end - chunk.first);
+			unit->done = false;
+			auto const size = (size_t)chunk.count*header.numBytesPerStar;
+			if (!local) {
+				chunk.data.resize(size);
+				PhaseTimer timer(PHASE_READ, size, chunk.count);
+				if (readFully(f, chunk.data.data(), size) != 0) {
+					spare.push_back(unit);
+					rv = -1;
+					break;
+				}
+			}
+			inFlight[numRead%window] = unit;
+			pool.submit(&group, [&run, unit] { run(unit); });
+			++numRead;
+		}
+		if (next == numRead) {
+			break;
+		}
+		auto const unit = inFlight[next%window];
+		pool.help([&] {
+			std::lock_guard<std::mutex> lock(mutex);
+			return unit->done;
+		});
+		if (failed) {
+			rv = -1;
+			break;
+		}
+		consume(&unit->result);
+		spare.push_back(unit);
+	}
+	pool.wait(&group);
+	if (local && rv == 0) {
+		rv = std::fseek(f, offset + (long)(end - begin)*header.numBytesPerStar, SEEK_SET);
+	}
+	return rv;
+}
+
+static
+void
+decode(
+    Batch* batch,
+    DecodeScratch* scratch,
+    Chunk const& chunk,
+    Header const& header,
+    Options const& options)
+{
+	batch->seq = chunk.seq;
+	batch->stars.clear();
+	batch->names.clear();
+
+	auto const layout = recordLayout(header);
+	auto const stride = (size_t)header.numBytesPerStar;
+
+	// The spectral class test needs a single byte, so it goes first and
+	// the rejected records are never decoded at all.
+	auto& rows = scratch->rows;
+	rows.clear();
+	if (options.spectralFilter) {
+		PhaseTimer timer(PHASE_FILTER);
+		rows.reserve(chunk.count);
+		auto const classes = options.spectralClasses;
+		for (auto i = 0; i < chunk.count; ++i) {
+			auto const c = chunk.data[i*stride + layout.spectralType];
+			if ((classes[c/64] >> (c%64)) & 1) {
+				rows.push_back(i);
+			}
+		}
+	}
+	auto const count = options.spectralFilter ? (int)rows.size() : chunk.count;
+
+	auto& table = scratch->table;
+	{
+		PhaseTimer timer(PHASE_DECODE, count*stride, count);
+		decodeColumns(&table, header, layout, chunk.data.data(),
+			      options.spectralFilter ? rows.data() : nullptr, count,
+			      options.filter.columns, options.filter.bands);
+	}
+	auto& mask = scratch->mask;
+	{
+		PhaseTimer timer(PHASE_FILTER, 0, chunk.count);
+		evaluateFilter(&mask, &scratch->stack, options.filter, table, header.starNameLength);
+	}
+
+	// No allocations from here on but for the arena's blocks.
+	PhaseTimer timer(PHASE_DECODE);
+	batch->stars.reserve(count);
+	for (size_t w = 0; w < mask.size(); ++w) {
+		for (auto bits = mask[w]; bits; bits &= bits - 1) {
+			auto const j = 64*w + __builtin_ctzll(bits);
+			auto const i = options.spectralFilter ? rows[j] : j;
+			Star star;
+			if (parseStar(&star, header, chunk.data.data() + i*stride, &batch->names) != 0) {
+				continue;
+			}
+			batch->stars.push_back(star);
+		}
+	}
+
+}
+
+static
+void
+formatStars(std::string* text, std::vector<Star> const& stars, Header const& header, Format const& format)
+{
+	PhaseTimer timer(PHASE_OUTPUT);
+	text->clear();
+	auto idx = 0;
+	for (auto const & star : stars) {
+		print(text, star, header, idx++, format);
+	}
+	if (profile.enabled) {
+		profile.bytes[PHASE_OUTPUT] += text->size();
+		profile.stars[PHASE_OUTPUT] += stars.size();
+	}
+}
+
+/*
+ * Sorts all stars, and builds the --lod levels from them if asked to,
+ * then formats them.  Returns the number of entries formatted.
+ */
+static
+size_t
+formatSorted(
+    std::string* text,
+    std::string* culling,
+    std::vector<Star>* stars,
+    char const* const inputfile,
+    Header const& header,
+    Options const& options)
+{
+	std::vector<std::uint32_t> order;
+	{
+		PhaseTimer timer(PHASE_SORT, 0, stars->size());
+		sortStars(&order, *stars, options.sort, options.numThreads);
+		if (options.lod > 0) {
+			std::vector<Star> levels;
+			buildLevels(&levels, *stars, order, header, options.lod);
+			stars->swap(levels);
+			order.resize(stars->size());
+			for (size_t i = 0; i < order.size(); ++i) {
+				order[i] = i;
+			}
+		}
+	}
+
+	PhaseTimer timer(PHASE_OUTPUT, 0, order.size());
+	auto idx = 0;
+	for (auto const index : order) {
+		print(text, (*stars)[index], header, idx++, options.format);
+	}
+	if (options.format.cull) {
+		printCCull(culling, inputfile, *stars, order);
+	}
+	return order.size();
+}
+
+/*
+ * --max-memory: sorted output beyond the budget is sorted in runs that
+ * are spilled to temporary files and then merged into the output.  Each
+ * star is a record of little-endian fields
+ *
+ *	f64 ra, f64 dec, f64 id, f32 magnitude, f32 per magnitude band,
+ *	f32 pmra, f32 pmdec, f64 rv, 2 characters of spectral type,
+ *	u32 level, u32 aggregated,
+ *
+ * then its name in a zero-padded field of starNameLength + 1 bytes.
+ */
+static size_t const RUN_BUFFER_SIZE = 1 << 20;
+
+struct Run {
+	std::unique_ptr<FILE, int (*)(FILE*)> file;
+	size_t count;
+};
+
+static
+size_t
+runRecordSize(Header const& header)
+{
+	return 3*8 + 4 + 4*header.numMagnitudes + 2*4 + 8 + 2 + 2*4 + header.starNameLength + 1;
+}
+
+static
+void
+appendRunRecord(std::string* buffer, Star const& star, Header const& header)
+{
+	appendLittleEndian(buffer, star.rightAscension);
+	appendLittleEndian(buffer, star.declination);
+	appendLittleEndian(buffer, star.starId);
+	appendLittleEndian(buffer, star.magnitude);
+	for (auto i = 0; i < header.numMagnitudes; ++i) {
+		appendLittleEndian(buffer, star.magnitudes[i]);
+	}
+	appendLittleEndian(buffer, star.properMotion.rightAscension);
+	appendLittleEndian(buffer, star.properMotion.declination);
+	appendLittleEndian(buffer, star.radialVelocity);
+	buffer->append(star.spectralType, 2);
+	appendLittleEndian(buffer, (std::uint32_t)star.level, 4);
+	appendLittleEndian(buffer, star.aggregated, 4);
+	auto const offset = buffer->size();
+	buffer->resize(offset + header.starNameLength + 1);
+	std::strncpy(&(*buffer)[offset], star.name, header.starNameLength);
+}
+
+// The star of a run record, its name pointing into the record.
+static
+void
+parseRunRecord(Star* star, char const* const record, Header const& header)
+{
+	auto p = (unsigned char const*)record;
+	*star = Star();
+	parse(&star->rightAscension, p, true);
+	parse(&star->declination, p + 8, true);
+	parse(&star->starId, p + 16, true);
+	parse(&star->magnitude, p + 24, true);
+	p += 28;
+	for (auto i = 0; i < header.numMagnitudes; ++i, p += 4) {
+		parse(&star->magnitudes[i], p, true);
+	}
+	parse(&star->properMotion.rightAscension, p, true);
+	parse(&star->properMotion.declination, p + 4, true);
+	parse(&star->radialVelocity, p + 8, true);
+	star->spectralType[0] = (char)p[16];
+	star->spectralType[1] = (char)p[17];
+	std::int32_t level;
+	parse(&level, p + 18, true);
+	star->level = level;
+	std::int32_t aggregated;
+	parse(&aggregated, p + 22, true);
+	star->aggregated = (std::uint32_t)aggregated;
+	star->name = (char const*)p + 26;
+}
+
+// Writes the stars in the given order as run records.
+static
+int
+writeRun(FILE* f, std::vector<Star> const& stars, std::vector<std::uint32_t> const& order, Header const& header)
+{
+	std::string buffer;
+	buffer.reserve(RUN_BUFFER_SIZE + runRecordSize(header));
+	for (size_t i = 0; i < order.size(); ++i) {
+		appendRunRecord(&buffer, stars[order[i]], header);
+		if (buffer.size() >= RUN_BUFFER_SIZE || i + 1 == order.size()) {
+			if (std::fwrite(buffer.data(), 1, buffer.size(), f) != buffer.size()) {
+				return -1;
+			}
+			buffer.clear();
+		}
+	}
+	return 0;
+}
+
+static
+int
+spillRun(std::vector<Run>* runs, std::vector<Star> const& stars, Header const& header, Options const& options)
+{
+	PhaseTimer timer(PHASE_SORT, 0, stars.size());
+	std::vector<std::uint32_t> order;
+	sortStars(&order, stars, options.sort, options.numThreads);
+
+	Run run = { std::unique_ptr<FILE, int (*)(FILE*)>(std::tmpfile(), fclose), stars.size() };
+	if (!run.file) {
+		std::fprintf(stderr, "sidus: failed to create temporary file: %s\n", std::strerror(errno));
+		return -1;
+	}
+	if (writeRun(run.file.get(), stars, order, header) != 0 || std::fflush(run.file.get()) != 0) {
+		std::fprintf(stderr, "sidus: failed to write temporary file: %s\n", std::strerror(errno));
+		return -1;
+	}
+	std::rewind(run.file.get());
+	runs->push_back(std::move(run));
+	return 0;
+}
+
+/*
+ * Reads the stars of a run back in order through a buffer of its own;
+ * the current star's name points into the buffer until the next read.
+ */
+class RunReader {
+public:
+	RunReader(Run* run, Header const& header, size_t const bufferSize)
+	    : run(run), header(header), recordSize(runRecordSize(header)),
+	      records(std::max<size_t>(1, bufferSize/recordSize)),
+	      buffer(records*recordSize), position(0), end(0)
+	{
+	}
+
+	// Returns 1 and the next star, 0 at the end of the run, or -1.
+	int
+	next(Star* star)
+	{
+		if (position == end) {
+			if (run->count == 0) {
+				return 0;
+			}
+			auto const count = std::min(records, run->count);
+			if (readFully(run->file.get(), buffer.data(), count*recordSize) != 0) {
+				std::fprintf(stderr, "sidus: failed to read temporary file\n");
+				return -1;
+			}
+			run->count -= count;
+			position = 0;
+			end = count*recordSize;
+		}
+		parseRunRecord(star, &buffer[position], header);
+		position += recordSize;
+		return 1;
+	}
+
+private:
+	Run* run;
+	Header const& header;
+	size_t recordSize;
+	size_t records;		// per buffer
+	std::vector<char> buffer;
+	size_t position;
+	size_t end;
+};
+
+/*
+ * K-way merges the sorted runs, calling visit with each star in order.
+ * Equal keys are taken from the earlier run first, which keeps the sort
+ * stable.
+ */
+template <typename Visit>
+static
+int
+mergeRuns(
+    std::vector<Run>* runs,
+    Header const& header,
+    std::vector<SortKey> const& keys,
+    size_t const maxMemory,
+    Visit visit)
+{
+	auto const bufferSize = maxMemory != 0 && !runs->empty() ?
+	    std::min(RUN_BUFFER_SIZE, maxMemory/runs->size()) : RUN_BUFFER_SIZE;
+	std::vector<RunReader> readers;
+	readers.reserve(runs->size());
+	for (auto& run : *runs) {
+		readers.emplace_back(&run, header, bufferSize);
+	}
+
+	typedef SortEntry<MAX_KEY_WORDS> Head;	// index is that of the run
+	auto const later = [](Head const& a, Head const& b) {
+		for (auto i = 0; i < MAX_KEY_WORDS; ++i) {
+			if (a.key[i] != b.key[i]) {
+				return a.key[i] > b.key[i];
+			}
+		}
+		return a.index > b.index;
+	};
+	std::vector<Star> current(readers.size());
+	std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+	for (size_t i = 0; i < readers.size(); ++i) {
+		auto const rv = readers[i].next(&current[i]);
+		if (rv < 0) {
+			return -1;
+		}
+		if (rv > 0) {
+			Head head;
+			encodeKeys(&head, current[i], keys);
+			head.index = (std::uint32_t)i;
+			heads.push(head);
+		}
+	}
+
+	while (!heads.empty()) {
+		auto head = heads.top();
+		heads.pop();
+		auto const i = head.index;
+		if (visit(current[i]) != 0) {
+			return -1;
+		}
+		auto const rv = readers[i].next(&current[i]);
+		if (rv < 0) {
+			return -1;
+		}
+		if (rv > 0) {
+			encodeKeys(&head, current[i], keys);
+			heads.push(head);
+		}
+	}
+	return 0;
+}
+
+// Merges the runs into the output.
+static
+int
+printRuns(
+    std::vector<Run>* runs,
+    char const* const inputfile,
+    size_t const numStars,
+    Header const& header,
+    Options const& options)
+{
+	PhaseTimer timer(PHASE_OUTPUT, 0, numStars);
+	std::string text;
+	if (options.format.cformat) {
+		printCHeader(&text, inputfile, numStars, header.epoch, options.format);
+	}
+	auto idx = 0;
+	auto ok = true;
+	auto const rv = mergeRuns(runs, header, options.sort, options.maxMemory, [&](Star const& star) {
+		print(&text, star, header, idx++, options.format);
+		if (text.size() >= RUN_BUFFER_SIZE) {
+			if (profile.enabled) {
+				profile.bytes[PHASE_OUTPUT] += text.size();
+			}
+			ok = std::fwrite(text.data(), 1, text.size(), stdout) == text.size();
+			text.clear();
+		}
+		return ok ? 0 : -1;
+	});
+	if (rv != 0 && ok) {
+		return -1;
+	}
+	if (options.format.cformat) {
+		printCFooter(&text, std::string());
+	}
+	if (profile.enabled) {
+		profile.bytes[PHASE_OUTPUT] += text.size();
+	}
+	ok = ok && std::fwrite(text.data(), 1, text.size(), stdout) == text.size();
+	if (!ok || std::fflush(stdout) != 0 || ferror(stdout)) {
+		std::fprintf(stderr, "sidus: failed to write output: %s\n", std::strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * --shard i/n converts the i-th of n equal ranges of records into a
+ * partial output for --merge-shards: its stars, sorted and stored as the
+ * runs of --max-memory hold them, after a header of little-endian u32s
+ *
+ *	"SIDUSSH2", i, n, stars, record size,
+ *	the catalog's stars, star id, name length, proper motion,
+ *	magnitudes, apparent magnitude, bytes per star, epoch, endianness,
+ *	sort keys, then field and descending for each,
+ *	input file name length, then the name.
+ */
+static char const SHARD_MAGIC[] = "SIDUSSH2";
+static int const SHARD_FIXED_SIZE = 8 + 4*14;
+
+struct ShardHeader {
+	int shard;
+	int numShards;
+	size_t numStars;
+	Header header;
+	std::vector<SortKey> sort;
+	std::string inputfile;
+};
+
+static
+void
+shardRange(int* begin, int* end, Header const& header, Options const& options)
+{
+	if (options.numShards == 0) {
+		*begin = 0;
+		*end = header.numStars;
+		return;
+	}
+	*begin = (int)((std::int64_t)header.numStars*(options.shard - 1)/options.numShards);
+	*end = (int)((std::int64_t)header.numStars*options.shard/options.numShards);
+}
+
+static
+int
+writeShard(
+    FILE* out,
+    std::vector<Run>* runs,
+    std::vector<Star> const* stars,
+    char const* const inputfile,
+    size_t const numStars,
+    Header const& header,
+    Options const& options)
+{
+	std::string buffer(SHARD_MAGIC, 8);
+	std::uint32_t const values[] = {
+		(std::uint32_t)options.shard, (std::uint32_t)options.numShards, (std::uint32_t)numStars,
+		(std::uint32_t)runRecordSize(header),
+		(std::uint32_t)header.numStars, (std::uint32_t)header.starId,
+		(std::uint32_t)header.starNameLength, (std::uint32_t)header.properMotion,
+		(std::uint32_t)header.numMagnitudes, (std::uint32_t)header.apparentMagnitude,
+		(std::uint32_t)header.numBytesPerStar, (std::uint32_t)header.epoch,
+		(std::uint32_t)header.littleEndian, (std::uint32_t)options.sort.size()
+	};
+	for (auto const value : values) {
+		appendLittleEndian(&buffer, value, 4);
+	}
+	for (auto const& key : options.sort) {
+		appendLittleEndian(&buffer, (std::uint32_t)key.field, 4);
+		appendLittleEndian(&buffer, key.descending ? 1 : 0, 4);
+	}
+	auto const length = std::strlen(inputfile);
+	appendLittleEndian(&buffer, length, 4);
+	buffer.append(inputfile, length);
+	auto ok = std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+
+	if (runs->empty()) {
+		std::vector<std::uint32_t> order;
+		{
+			PhaseTimer timer(PHASE_SORT, 0, stars->size());
+			sortStars(&order, *stars, options.sort, options.numThreads);
+		}
+		PhaseTimer timer(PHASE_OUTPUT, 0, order.size());
+		ok = ok && writeRun(out, *stars, order, header) == 0;
+	} else {
+		PhaseTimer timer(PHASE_OUTPUT, 0, numStars);
+		buffer.clear();
+		ok = ok && mergeRuns(runs, header, options.sort, options.maxMemory, [&](Star const& star) {
+			appendRunRecord(&buffer, star, header);
+			if (buffer.size() >= RUN_BUFFER_SIZE) {
+				if (std::fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size()) {
+					return -1;
+				}
+				buffer.clear();
+			}
+			return 0;
+		}) == 0;
+		ok = ok && std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+	}
+	if (!ok || std::fflush(out) != 0) {
+		std::fprintf(stderr, "sidus: failed to write shard\n");
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+readShardHeader(ShardHeader* shard, FILE* f, char const* const path)
+{
+	unsigned char fixed[SHARD_FIXED_SIZE];
+	if (readFully(f, fixed, sizeof fixed) != 0 || std::memcmp(fixed, SHARD_MAGIC, 8) != 0) {
+		std::fprintf(stderr, "sidus: %s: not a shard\n", path);
+		return -1;
+	}
+	std::int32_t values[(SHARD_FIXED_SIZE - 8)/4];
+	for (size_t i = 0; i < sizeof values/sizeof *values; ++i) {
+		parse(&values[i], fixed + 8 + 4*i, true);
+	}
+	shard->shard = values[0];
+	shard->numShards = values[1];
+	shard->numStars = (std::uint32_t)values[2];
+	auto& header = shard->header;
+	header.numStars = values[4];
+	header.starId = (Header::StarId)values[5];
+	header.starNameLength = values[6];
+	header.properMotion = (Header::ProperMotion)values[7];
+	header.numMagnitudes = values[8];
+	header.apparentMagnitude = values[9];
+	header.numBytesPerStar = values[10];
+	header.epoch = (Epoch)values[11];
+	header.littleEndian = values[12] != 0;
+	if (header.starNameLength < 0 ||
+	    header.numMagnitudes < 0 || header.numMagnitudes > MAX_MAGNITUDES ||
+	    values[3] != (std::int32_t)runRecordSize(header)) {
+		std::fprintf(stderr, "sidus: %s: invalid record size\n", path);
+		return -1;
+	}
+
+	auto const numKeys = values[13];
+	unsigned char raw[8];
+	shard->sort.clear();
+	for (auto i = 0; i < numKeys; ++i) {
+		std::int32_t field, descending;
+		if (readFully(f, raw, sizeof raw) != 0) {
+			std::fprintf(stderr, "sidus: %s: failed to read file\n", path);
+			return -1;
+		}
+		parse(&field, raw, true);
+		parse(&descending, raw + 4, true);
+		if (field < 0 || field > (std::int32_t)SortField::CELL) {
+			std::fprintf(stderr, "sidus: %s: invalid sort key\n", path);
+			return -1;
+		}
+		shard->sort.push_back(SortKey{ (SortField)field, descending != 0 });
+	}
+	std::int32_t length;
+	if (readFully(f, raw, 4) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", path);
+		return -1;
+	}
+	parse(&length, raw, true);
+	shard->inputfile.resize(std::max(0, length));
+	if (length < 0 || readFully(f, &shard->inputfile[0], length) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static
+bool
+sameConversion(ShardHeader const& a, ShardHeader const& b)
+{
+	auto const& x = a.header;
+	auto const& y = b.header;
+	if (x.numStars != y.numStars || x.starId != y.starId || x.starNameLength != y.starNameLength ||
+	    x.properMotion != y.properMotion || x.numMagnitudes != y.numMagnitudes ||
+	    x.apparentMagnitude != y.apparentMagnitude || x.numBytesPerStar != y.numBytesPerStar ||
+	    x.epoch != y.epoch || x.littleEndian != y.littleEndian ||
+	    a.numShards != b.numShards || a.inputfile != b.inputfile || a.sort.size() != b.sort.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.sort.size(); ++i) {
+		if (a.sort[i].field != b.sort[i].field || a.sort[i].descending != b.sort[i].descending) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * --merge-shards: the partial outputs of all shards of one conversion,
+ * in any order, are merged into its output as --max-memory merges runs.
+ */
+static
+int
+mergeShards(std::vector<char const*> const& paths, Options* options)
+{
+	std::vector<ShardHeader> shards(paths.size());
+	std::vector<Run> runs;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		Run run = { std::unique_ptr<FILE, int (*)(FILE*)>(fopen(paths[i], "rb"), fclose), 0 };
+		if (!run.file) {
+			std::fprintf(stderr, "sidus: %s: failed to open file\n", paths[i]);
+			return -1;
+		}
+		if (readShardHeader(&shards[i], run.file.get(), paths[i]) != 0) {
+			return -1;
+		}
+		if (!sameConversion(shards[i], shards[0])) {
+			std::fprintf(stderr, "sidus: %s: not a shard of the same conversion as %s\n",
+				     paths[i], paths[0]);
+			return -1;
+		}
+		run.count = shards[i].numStars;
+		runs.push_back(std::move(run));
+	}
+
+	// Merged in record order, so that equal keys keep it.
+	std::vector<Run> ordered;
+	size_t numStars = 0;
+	for (auto shard = 1; shard <= (int)shards.size(); ++shard) {
+		size_t found = 0;
+		for (size_t i = 0; i < shards.size(); ++i) {
+			if (shards[i].shard == shard) {
+				found = i + 1;
+			}
+		}
+		if (found == 0 || shards[0].numShards != (int)shards.size()) {
+			std::fprintf(stderr, "sidus: --merge-shards needs each of the %d shards once\n",
+				     shards[0].numShards);
+			return -1;
+		}
+		numStars += shards[found - 1].numStars;
+		ordered.push_back(std::move(runs[found - 1]));
+	}
+
+	auto const& header = shards[0].header;
+	auto bands = 1u << header.apparentMagnitude;
+	for (auto const band : options->format.bands) {
+		bands |= 1u << band;
+	}
+	for (auto const& color : options->format.colors) {
+		bands |= (1u << color.first) | (1u << color.second);
+	}
+	if (bands >> header.numMagnitudes) {
+		std::fprintf(stderr, "sidus: magnitude band out of range, catalog has %d\n",
+			     header.numMagnitudes);
+		return -1;
+	}
+	if (header.starNameLength == 0) {
+		options->format.usename = false;
+	}
+	options->sort = shards[0].sort;
+	return printRuns(&ordered, shards[0].inputfile.c_str(), numStars, header, *options);
+}
+
+/*
+ * --tiles with --max-memory: the first pass spreads the stars bright
+ * enough for any level over buckets by their HEALPix cell at a coarse
+ * order, buffering each bucket and appending it in blocks to a temporary
+ * file.  The second tiles the buckets one at a time in parallel into
+ * segments, one per level and bucket, in another.  The segments are then
+ * copied into the output, or merged by magnitude for the levels coarser
+ * than the buckets.
+ */
+static int const TILE_MAX_BUCKET_ORDER = 4;
+
+struct TileStar {
+	double rightAscension;
+	double declination;
+	float magnitude;
+	char spectralType[2];
+	std::uint64_t index;	// among all stars, for equal magnitudes
+};
+
+static
+bool
+brighter(TileStar const& a, TileStar const& b)
+{
+	auto const ka = encodeKey(a.magnitude);
+	auto const kb = encodeKey(b.magnitude);
+	return ka != kb ? ka < kb : a.index < b.index;
+}
+
+// A temporary file of TileStars, appended to and read by several threads.
+class TileFile {
+public:
+	TileFile()
+	    : file(std::tmpfile(), fclose), size(0)
+	{
+	}
+
+	bool
+	isOpen() const
+	{
+		return file != nullptr;
+	}
+
+	// Appends the stars, returning their offset or -1.
+	std::int64_t
+	append(TileStar const* stars, size_t const count)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto const offset = size;
+		if (std::fseek(file.get(), offset, SEEK_SET) != 0 ||
+		    std::fwrite(stars, sizeof *stars, count, file.get()) != count) {
+			return -1;
+		}
+		size += count*sizeof *stars;
+		return offset;
+	}
+
+	int
+	read(TileStar* stars, size_t const count, std::int64_t const offset)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (std::fseek(file.get(), offset, SEEK_SET) != 0 ||
+		    std::fread(stars, sizeof *stars, count, file.get()) != count) {
+			return -1;
+		}
+		return 0;
+	}
+
+private:
+	std::unique_ptr<FILE, int (*)(FILE*)> file;
+	std::int64_t size;
+	std::mutex mutex;
+};
+
+struct TileSegment {
+	std::int64_t offset;
+	size_t count;
+};
+
+class TileBuckets {
+public:
+	TileBuckets(int const order, size_t const blockSize)
+	    : order(order),
+	      blockStars(std::max<size_t>(1, blockSize/sizeof(TileStar))),
+	      buffers((size_t)12 << (2*order)),
+	      blocks((size_t)12 << (2*order)),
+	      counts((size_t)12 << (2*order), 0)
+	{
+	}
+
+	int
+	add(TileStar const& star)
+	{
+		auto const bucket = healpixIndex(star.rightAscension, star.declination, HEALPIX_ORDER) >>
+		    2*(HEALPIX_ORDER - order);
+		auto& buffer = buffers[bucket];
+		if (buffer.empty()) {
+			buffer.reserve(blockStars);
+		}
+		buffer.push_back(star);
+		++counts[bucket];
+		return buffer.size() == blockStars ? flush(bucket) : 0;
+	}
+
+	int
+	finish()
+	{
+		for (size_t bucket = 0; bucket < buffers.size(); ++bucket) {
+			if (flush(bucket) != 0) {
+				return -1;
+			}
+			std::vector<TileStar>().swap(buffers[bucket]);
+		}
+		return 0;
+	}
+
+	int
+	load(std::vector<TileStar>* stars, size_t const bucket)
+	{
+		stars->resize(counts[bucket]);
+		size_t loaded = 0;
+		for (auto const& block : blocks[bucket]) {
+			if (file.read(stars->data() + loaded, block.count, block.offset) != 0) {
+				return -1;
+			}
+			loaded += block.count;
+		}
+		return 0;
+	}
+
+	bool
+	isOpen() const
+	{
+		return file.isOpen();
+	}
+
+	int
+	getOrder() const
+	{
+		return order;
+	}
+
+private:
+	int
+	flush(size_t const bucket)
+	{
+		auto& buffer = buffers[bucket];
+		if (buffer.empty()) {
+			return 0;
+		}
+		auto const offset = file.append(buffer.data(), buffer.size());
+		if (offset < 0) {
+			return -1;
+		}
+		blocks[bucket].push_back(TileSegment{ offset, buffer.size() });
+		buffer.clear();
+		return 0;
+	}
+
+	int order;
+	size_t blockStars;
+	TileFile file;
+	std::vector<std::vector<TileStar>> buffers;
+	std::vector<std::vector<TileSegment>> blocks;
+	std::vector<size_t> counts;
+};
+
+// Reads a segment back in order through a buffer of its own.
+class TileSegmentReader {
+public:
+	TileSegmentReader(TileFile* file, TileSegment const& segment, size_t const bufferStars)
+	    : file(file), segment(segment), buffer(std::max<size_t>(1, bufferStars)), position(0), end(0)
+	{
+	}
+
+	// Returns 1 and the next star, 0 at the end of the segment, or -1.
+	int
+	next(TileStar const** star)
+	{
+		if (position == end) {
+			if (segment.count == 0) {
+				return 0;
+			}
+			auto const count = std::min(buffer.size(), segment.count);
+			if (file->read(buffer.data(), count, segment.offset) != 0) {
+				return -1;
+			}
+			segment.offset += count*sizeof(TileStar);
+			segment.count -= count;
+			position = 0;
+			end = count;
+		}
+		*star = &buffer[position++];
+		return 1;
+	}
+
+private:
+	TileFile* file;
+	TileSegment segment;
+	std::vector<TileStar> buffer;
+	size_t position;
+	size_t end;
+};
+
+/*
+ * Tiles one bucket: its stars of each level in tile order, brightest
+ * first within a tile, are appended to segments as one segment, and the
+ * levels at least as fine as the buckets get their tile counts.
+ */
+static
+int
+tileBucket(
+    TileFile* segments,
+    std::vector<std::vector<TileSegment>>* levels,
+    std::vector<std::vector<std::uint32_t>>* counts,
+    std::vector<TileStar>* stars,
+    TileBuckets* buckets,
+    size_t const bucket,
+    std::vector<float> const& limits)
+{
+	if (buckets->load(stars, bucket) != 0) {
+		return -1;
+	}
+	std::sort(stars->begin(), stars->end(), brighter);
+	std::vector<std::uint64_t> cells(stars->size());
+	for (size_t i = 0; i < stars->size(); ++i) {
+		cells[i] = healpixIndex((*stars)[i].rightAscension, (*stars)[i].declination, HEALPIX_ORDER);
+	}
+
+	std::vector<std::uint32_t> members;
+	std::vector<TileStar> segment;
+	for (size_t level = 0; level < limits.size(); ++level) {
+		members.clear();
+		for (size_t i = 0; i < stars->size() && !((*stars)[i].magnitude >= limits[level]); ++i) {
+			members.push_back(i);
+		}
+		auto const shift = 2*(HEALPIX_ORDER - (int)level);
+		std::stable_sort(members.begin(), members.end(), [&](std::uint32_t a, std::uint32_t b) {
+			return (cells[a] >> shift) < (cells[b] >> shift);
+		});
+		segment.clear();
+		for (auto const i : members) {
+			segment.push_back((*stars)[i]);
+			if ((int)level >= buckets->getOrder()) {
+				++(*counts)[level][cells[i] >> shift];
+			}
+		}
+		auto const offset = segments->append(segment.data(), segment.size());
+		if (offset < 0) {
+			return -1;
+		}
+		(*levels)[level][bucket] = TileSegment{ offset, segment.size() };
+	}
+	return 0;
+}
+
+static
+int
+writeBucketedTiles(
+    char const* const path,
+    TileBuckets* buckets,
+    std::vector<float> const& limits,
+    Epoch const epoch,
+    size_t const maxMemory)
+{
+	auto const order = buckets->getOrder();
+	auto const numBuckets = (size_t)12 << (2*order);
+	auto const numLevels = (int)limits.size();
+	std::vector<std::vector<TileSegment>> levels(numLevels, std::vector<TileSegment>(numBuckets));
+	std::vector<std::vector<std::uint32_t>> counts(numLevels);
+	for (auto level = 0; level < numLevels; ++level) {
+		counts[level].assign((size_t)12 << (2*level), 0);
+	}
+
+	TileFile segments;
+	if (!segments.isOpen()) {
+		std::fprintf(stderr, "sidus: failed to create temporary file: %s\n", std::strerror(errno));
+		return -1;
+	}
+	{
+		PhaseTimer timer(PHASE_SORT);
+		std::atomic<int> status(0);
+		std::unique_ptr<std::vector<TileStar>[]> stars(new std::vector<TileStar>[pool.size()]);
+		pool.parallelFor(numBuckets, [&](size_t const bucket) {
+			if (status == 0 &&
+			    tileBucket(&segments, &levels, &counts, &stars[pool.slot()], buckets, bucket, limits) != 0) {
+				status = -1;
+			}
+		});
+		if (status != 0) {
+			std::fprintf(stderr, "sidus: failed to read or write temporary file\n");
+			return -1;
+		}
+	}
+
+	PhaseTimer timer(PHASE_OUTPUT);
+	for (auto level = 0; level < std::min(order, numLevels); ++level) {
+		auto const perTile = (size_t)1 << (2*(order - level));
+		for (size_t tile = 0; tile < counts[level].size(); ++tile) {
+			for (size_t bucket = tile*perTile; bucket < (tile + 1)*perTile; ++bucket) {
+				counts[level][tile] += levels[level][bucket].count;
+			}
+		}
+	}
+	std::string records;
+	appendTileHeader(&records, limits, epoch, counts);
+
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", path);
+		return -1;
+	}
+	std::unique_ptr<FILE, int (*)(FILE*)> file(f, fclose);
+	auto ok = true;
+	for (auto level = 0; level < numLevels && ok; ++level) {
+		// Each tile of a coarse level merges the segments of the
+		// buckets within it, each tile of a fine one lies within a
+		// single bucket's segment.
+		auto const perTile = level < order ? (size_t)1 << (2*(order - level)) : 1;
+		auto const bufferStars = std::min(RUN_BUFFER_SIZE, maxMemory/(4*perTile))/sizeof(TileStar);
+		for (size_t first = 0; first < numBuckets && ok; first += perTile) {
+			std::vector<TileSegmentReader> readers;
+			for (auto bucket = first; bucket < first + perTile; ++bucket) {
+				readers.emplace_back(&segments, levels[level][bucket], bufferStars);
+			}
+			std::vector<TileStar const*> current(perTile);
+			auto const later = [&](size_t a, size_t b) {
+				return brighter(*current[b], *current[a]);
+			};
+			std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+			for (size_t i = 0; i < perTile && ok; ++i) {
+				auto const rv = readers[i].next(&current[i]);
+				ok = rv >= 0;
+				if (rv > 0) {
+					heads.push(i);
+				}
+			}
+			while (!heads.empty() && ok) {
+				auto const i = heads.top();
+				heads.pop();
+				auto const& star = *current[i];
+				appendTileRecord(&records, star.rightAscension, star.declination, star.magnitude,
+						 star.spectralType);
+				if (records.size() >= RUN_BUFFER_SIZE) {
+					ok = std::fwrite(records.data(), 1, records.size(), f) == records.size();
+					records.clear();
+				}
+				auto const rv = readers[i].next(&current[i]);
+				ok = ok && rv >= 0;
+				if (rv > 0) {
+					heads.push(i);
+				}
+			}
+		}
+	}
+	ok = ok && std::fwrite(records.data(), 1, records.size(), f) == records.size();
+	if (!ok || fclose(file.release()) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to write file\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+convert(
+    FILE* f,
+    char const* const inputfile,
+    Header const& header,
+    Options const& options)
+{
+	// Sorted stars, and those of a shard, are collected rather than
+	// written as they come.  With --max-memory they are spilled in runs
+	// of at most runStars, each star costing its name and sort entries
+	// besides.
+	auto const collect = !options.sort.empty() || options.numShards != 0;
+	size_t runStars = 0;
+	if (options.maxMemory != 0 && collect && !options.tiles) {
+		runStars = options.maxMemory/(sizeof(Star) + header.starNameLength + 1 +
+		    2*sizeof(SortEntry<MAX_KEY_WORDS>) + sizeof(std::uint32_t));
+		if (runStars < (size_t)CHUNK_STARS) {
+			std::fprintf(stderr, "sidus: --max-memory too small, a run must hold %d stars\n",
+				     CHUNK_STARS);
+			return -1;
+		}
+	}
+
+	// And --tiles spreads the stars over buckets that are, for a sky
+	// evenly covered, small enough to tile a few at a time.
+	std::unique_ptr<TileBuckets> buckets;
+	auto const faintest = options.tiles ?
+	    *std::max_element(options.tileLimits.begin(), options.tileLimits.end()) : 0.0f;
+	if (options.maxMemory != 0 && options.tiles) {
+		auto order = 0;
+		auto const perBucket = options.maxMemory/(4*std::max(1, options.numThreads));
+		while (order < TILE_MAX_BUCKET_ORDER &&
+		       (size_t)header.numStars*sizeof(TileStar) > perBucket*((size_t)12 << (2*order))) {
+			++order;
+		}
+		auto const blockSize = std::max<size_t>(4096, options.maxMemory/(4*((size_t)12 << (2*order))));
+		buckets.reset(new TileBuckets(order, std::min(blockSize, RUN_BUFFER_SIZE)));
+		if (!buckets->isOpen()) {
+			std::fprintf(stderr, "sidus: failed to create temporary file: %s\n", std::strerror(errno));
+			return -1;
+		}
+	}
+
+	int begin, end;
+	shardRange(&begin, &end, header, options);
+	if (begin > 0 && std::fseek(f, (long)begin*header.numBytesPerStar, SEEK_CUR) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+		return -1;
+	}
+
+	size_t numWritten = 0;
+	std::vector<std::string> texts;
+	std::vector<Star> sorted;
+	std::vector<Arena> names;	// of the sorted stars
+	std::vector<Run> runs;
+	auto spillStatus = 0;
+	std::string culling;
+	if (runStars != 0) {
+		sorted.reserve(runStars);
+	}
+	std::unique_ptr<DecodeScratch[]> scratch(new DecodeScratch[pool.size()]);
+	auto const work = [&](Batch* batch, Chunk const& chunk) {
+		decode(batch, &scratch[pool.slot()], chunk, header, options);
+		if (!collect) {
+			formatStars(&batch->text, batch->stars, header, options.format);
+		}
+	};
+	auto const consume = [&](Batch* ready) {
+		if (buckets) {
+			for (auto const& star : ready->stars) {
+				if (spillStatus == 0 && star.magnitude < faintest) {
+					TileStar tileStar;
+					tileStar.rightAscension = star.rightAscension;
+					tileStar.declination = star.declination;
+					tileStar.magnitude = star.magnitude;
+					std::memcpy(tileStar.spectralType, star.spectralType, 2);
+					tileStar.index = numWritten;
+					spillStatus = buckets->add(tileStar);
+				}
+				++numWritten;
+			}
+		}
+		else if (collect) {
+			if (runStars != 0 && sorted.size() + ready->stars.size() > runStars) {
+				if (spillStatus == 0) {
+					spillStatus = spillRun(&runs, sorted, header, options);
+				}
+				numWritten += sorted.size();
+				sorted.clear();
+				names.clear();
+			}
+			sorted.insert(sorted.end(), ready->stars.begin(), ready->stars.end());
+			names.push_back(std::move(ready->names));
+		}
+		else if (!ready->stars.empty()) {
+			if (options.format.cformat) {
+				if (numWritten != 0) {
+					texts.push_back(", ");
+				}
+				texts.push_back(std::move(ready->text));
+			} else {
+				PhaseTimer timer(PHASE_OUTPUT);
+				std::fwrite(ready->text.data(), 1, ready->text.size(), stdout);
+			}
+			numWritten += ready->stars.size();
+		}
+	};
+	if (processChunks<Batch>(f, header, begin, end, work, consume) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+		return -1;
+	}
+
+	if (buckets) {
+		if (spillStatus != 0 || buckets->finish() != 0) {
+			std::fprintf(stderr, "sidus: failed to write temporary file: %s\n", std::strerror(errno));
+			return -1;
+		}
+		return writeBucketedTiles(options.tiles, buckets.get(), options.tileLimits, header.epoch,
+					  options.maxMemory);
+	}
+
+	if (!runs.empty()) {
+		if (spillStatus != 0 || spillRun(&runs, sorted, header, options) != 0) {
+			return -1;
+		}
+		numWritten += sorted.size();
+		sorted = std::vector<Star>();
+		names.clear();
+		if (options.numShards != 0) {
+			return writeShard(stdout, &runs, nullptr, inputfile, numWritten, header, options);
+		}
+		return printRuns(&runs, inputfile, numWritten, header, options);
+	}
+
+	if (options.numShards != 0) {
+		return writeShard(stdout, &runs, &sorted, inputfile, sorted.size(), header, options);
+	}
+
+	if (options.tiles) {
+		std::vector<std::uint32_t> order;
+		{
+			PhaseTimer timer(PHASE_SORT, 0, sorted.size());
+			sortStars(&order, sorted, options.sort, options.numThreads);
+		}
+		PhaseTimer timer(PHASE_OUTPUT, 0, order.size());
+		return writeTiles(options.tiles, sorted, order, options.tileLimits, header.epoch);
+	}
+
+	if (!options.sort.empty()) {
+		std::string text;
+		numWritten = formatSorted(&text, &culling, &sorted, inputfile, header, options);
+		if (profile.enabled) {
+			profile.bytes[PHASE_OUTPUT] += text.size();
+		}
+		texts.push_back(std::move(text));
+	}
+
+	std::string prologue, epilogue;
+	if (options.format.cformat) {
+		printCHeader(&prologue, inputfile, numWritten, header.epoch, options.format);
+		printCFooter(&epilogue, culling);
+	}
+	PhaseTimer timer(PHASE_OUTPUT);
+	std::fwrite(prologue.data(), 1, prologue.size(), stdout);
+	for (auto const & text : texts) {
+		std::fwrite(text.data(), 1, text.size(), stdout);
+	}
+	std::fwrite(epilogue.data(), 1, epilogue.size(), stdout);
+
+	return 0;
+}
+
+/*
+ * --stats: one pass over all records, each chunk accumulated by a task
+ * into the Stats of the thread running it, with the thread's decode
+ * buffers reused across chunks; the Stats are merged at the end.
+ */
+static int const STATS_MIN_MAGNITUDE = -2;
+static int const STATS_NUM_BINS = 24;	// one magnitude each, ends are open
+static int const STATS_HEALPIX_ORDER = 3;
+static int const STATS_NUM_CELLS = 12 << (2*STATS_HEALPIX_ORDER);
+
+struct Range {
+	double min;
+	double max;
+
+	void
+	add(double const value)
+	{
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+
+	void
+	add(Range const& other)
+	{
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+	}
+};
+
+struct Stats {
+	size_t records;
+	size_t invalid;
+	size_t stars;
+	double magnitudeSum;
+	Range magnitude;
+	Range rightAscension;
+	Range declination;
+	Range properMotionRA;
+	Range properMotionDec;
+	Range radialVelocity;
+	size_t histogram[STATS_NUM_BINS];
+	size_t spectralClasses[256];
+	std::uint64_t cells[STATS_NUM_CELLS/64];
+};
+
+static
+void
+resetStats(Stats* stats)
+{
+	std::memset(stats, 0, sizeof *stats);
+	Range const empty = { DBL_MAX, -DBL_MAX };
+	stats->magnitude = empty;
+	stats->rightAscension = empty;
+	stats->declination = empty;
+	stats->properMotionRA = empty;
+	stats->properMotionDec = empty;
+	stats->radialVelocity = empty;
+}
+
+static
+void
+mergeStats(Stats* stats, Stats const& other)
+{
+	stats->records += other.records;
+	stats->invalid += other.invalid;
+	stats->stars += other.stars;
+	stats->magnitudeSum += other.magnitudeSum;
+	stats->magnitude.add(other.magnitude);
+	stats->rightAscension.add(other.rightAscension);
+	stats->declination.add(other.declination);
+	stats->properMotionRA.add(other.properMotionRA);
+	stats->properMotionDec.add(other.properMotionDec);
+	stats->radialVelocity.add(other.radialVelocity);
+	for (auto i = 0; i < STATS_NUM_BINS; ++i) {
+		stats->histogram[i] += other.histogram[i];
+	}
+	for (auto i = 0; i < 256; ++i) {
+		stats->spectralClasses[i] += other.spectralClasses[i];
+	}
+	for (auto i = 0; i < STATS_NUM_CELLS/64; ++i) {
+		stats->cells[i] |= other.cells[i];
+	}
+}
+
+static
+void
+accumulate(
+    Stats* stats,
+    DecodeScratch* scratch,
+    Chunk const& chunk,
+    Header const& header,
+    Options const& options)
+{
+	auto const layout = recordLayout(header);
+	auto const columns = options.filter.columns |
+	    COLUMN_MAG | COLUMN_RA | COLUMN_DEC | COLUMN_SPECTRAL |
+	    COLUMN_PMRA | COLUMN_PMDEC | COLUMN_RV;
+	auto& table = scratch->table;
+	{
+		PhaseTimer timer(PHASE_DECODE, chunk.data.size(), chunk.count);
+		decodeColumns(&table, header, layout, chunk.data.data(), nullptr, chunk.count,
+			      columns, options.filter.bands);
+	}
+	auto& mask = scratch->mask;
+	{
+		PhaseTimer timer(PHASE_FILTER, 0, chunk.count);
+		evaluateFilter(&mask, &scratch->stack, options.filter, table, header.starNameLength);
+	}
+
+	// Accumulating takes the place of formatting output.
+	PhaseTimer timer(PHASE_OUTPUT, 0, chunk.count);
+	stats->records += chunk.count;
+	for (auto i = 0; i < chunk.count; ++i) {
+		stats->invalid +=
+		    table.magnitude[i] == 0.0f &&
+		    table.rightAscension[i] == 0.0 &&
+		    table.declination[i] == 0.0;
+	}
+
+	auto const chars = (unsigned char const*)table.spectralType.data();
+	for (size_t w = 0; w < mask.size(); ++w) {
+		for (auto bits = mask[w]; bits; bits &= bits - 1) {
+			auto const i = 64*w + __builtin_ctzll(bits);
+			auto const c = chars[2*i];
+			if (options.spectralFilter &&
+			    !((options.spectralClasses[c/64] >> (c%64)) & 1)) {
+				continue;
+			}
+			auto const mag = table.magnitude[i];
+			auto const ra = table.rightAscension[i];
+			auto const dec = table.declination[i];
+			++stats->stars;
+			stats->magnitudeSum += mag;
+			stats->magnitude.add(mag);
+			stats->rightAscension.add(ra);
+			stats->declination.add(dec);
+			stats->properMotionRA.add(table.properMotionRA[i]);
+			stats->properMotionDec.add(table.properMotionDec[i]);
+			stats->radialVelocity.add(table.radialVelocity[i]);
+			auto const bin = (int)std::floor(mag) - STATS_MIN_MAGNITUDE;
+			++stats->histogram[std::min(std::max(bin, 0), STATS_NUM_BINS - 1)];
+			++stats->spectralClasses[c];
+			auto const cell = healpixIndex(ra, dec, STATS_HEALPIX_ORDER);
+			stats->cells[cell/64] |= (std::uint64_t)1 << (cell%64);
+		}
+	}
+}
+
+static
+void
+printStats(Stats const& stats, Header const& header)
+{
+	std::fprintf(stdout,
+		     "Catalog statistics:\n"
+		     " Records: %zu\n"
+		     " Invalid entries: %zu\n"
+		     " Filtered out: %zu\n"
+		     " Stars: %zu\n",
+		     stats.records,
+		     stats.invalid,
+		     stats.records - stats.invalid - stats.stars,
+		     stats.stars);
+	if (stats.stars == 0) {
+		return;
+	}
+
+	std::fprintf(stdout,
+		     " Magnitude: %.2f to %.2f, mean %.2f\n"
+		     " Magnitude histogram:\n",
+		     stats.magnitude.min, stats.magnitude.max,
+		     stats.magnitudeSum/stats.stars);
+	for (auto i = 0; i < STATS_NUM_BINS; ++i) {
+		if (stats.histogram[i] == 0) {
+			continue;
+		}
+		auto const low = i + STATS_MIN_MAGNITUDE;
+		if (i == 0) {
+			std::fprintf(stdout, "  [    , %3d): %zu\n", low + 1, stats.histogram[i]);
+		}
+		else if (i == STATS_NUM_BINS - 1) {
+			std::fprintf(stdout, "  [%3d,     ): %zu\n", low, stats.histogram[i]);
+		} else {
+			std::fprintf(stdout, "  [%3d, %3d): %zu\n", low, low + 1, stats.histogram[i]);
+		}
+	}
+
+	auto cells = 0;
+	for (auto const word : stats.cells) {
+		cells += __builtin_popcountll(word);
+	}
+	std::fprintf(stdout,
+		     " Right ascension: %.6f to %.6f radians\n"
+		     " Declination: %.6f to %.6f radians\n"
+		     " Sky coverage: %d of %d HEALPix cells (%.1f%%)\n",
+		     stats.rightAscension.min, stats.rightAscension.max,
+		     stats.declination.min, stats.declination.max,
+		     cells, STATS_NUM_CELLS, 100.0*cells/STATS_NUM_CELLS);
+
+	if (header.properMotion == Header::PROPER_MOTION) {
+		std::fprintf(stdout,
+			     " Proper motion in right ascension: %g to %g radians/year\n"
+			     " Proper motion in declination: %g to %g radians/year\n",
+			     stats.properMotionRA.min, stats.properMotionRA.max,
+			     stats.properMotionDec.min, stats.properMotionDec.max);
+	}
+	else if (header.properMotion == Header::RADIAL_VELOCITY) {
+		std::fprintf(stdout,
+			     " Radial velocity: %g to %g km/s\n",
+			     stats.radialVelocity.min, stats.radialVelocity.max);
+	}
+
+	std::fputs(" Spectral classes:\n", stdout);
+	for (auto c = 0; c < 256; ++c) {
+		if (stats.spectralClasses[c] == 0) {
+			continue;
+		}
+		std::fprintf(stdout, std::isprint(c) ? "  %c: %zu (%.1f%%)\n" : "  \\x%02x: %zu (%.1f%%)\n",
+			     c, stats.spectralClasses[c],
+			     100.0*stats.spectralClasses[c]/stats.stars);
+	}
+}
+
+static
+int
+computeStats(
+    FILE* f,
+    char const* const inputfile,
+    Header const& header,
+    Options const& options)
+{
+	// One accumulator and set of buffers per thread of the pool, merged
+	// once all chunks are in.
+	std::vector<Stats> partials(pool.size());
+	for (auto& partial : partials) {
+		resetStats(&partial);
+	}
+	std::vector<DecodeScratch> scratch(pool.size());
+	auto const work = [&](bool*, Chunk const& chunk) {
+		auto const slot = pool.slot();
+		accumulate(&partials[slot], &scratch[slot], chunk, header, options);
+	};
+	auto const consume = [](bool*) {};
+	if (processChunks<bool>(f, header, 0, header.numStars, work, consume) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+		return -1;
+	}
+	Stats stats;
+	resetStats(&stats);
+	for (auto const& partial : partials) {
+		mergeStats(&stats, partial);
+	}
+	printStats(stats, header);
+	return 0;
+}
+
+
+/*
+ * --serve: the catalog is mapped and decoded once, indexed by id,
+ * magnitude and declination, and queried by local clients over a Unix
+ * domain socket.  Each connection gets its own thread and may send any
+ * number of requests, each answered in turn.  All integers and doubles
+ * are in host byte order:
+ *
+ *   request  := u32 size, u8 op, payload (size counts op and payload)
+ *     SERVE_ID      f64 id
+ *     SERVE_CONE    f64 ra, f64 dec, f64 radius, u32 limit (radians)
+ *     SERVE_TOP     u32 k, filter expression (may be empty)
+ *     SERVE_FILTER  u32 limit, filter expression
+ *   response := u32 status, u32 count, u32 size, size bytes
+ *
+ * On success the bytes are count catalog records exactly as in the file,
+ * brightest first for SERVE_TOP, by declination for SERVE_CONE and in
+ * file order otherwise.  On failure they are an error message.  Stars
+ * excluded by -f, --filter or --spectral at startup are never returned.
+ */
+enum ServeOp {
+	SERVE_ID = 1,
+	SERVE_CONE = 2,
+	SERVE_TOP = 3,
+	SERVE_FILTER = 4
+};
+
+static std::uint32_t const SERVE_MAX_REQUEST = 64 << 10;
+static size_t const SERVE_CACHED_FILTERS = 8;
+
+struct Selected {
+	std::vector<std::uint64_t> mask;	// of the served stars matching
+	double brightest;	// the magnitudes that can match at all
+	double faintest;
+};
+
+typedef std::shared_ptr<Selected const> Selection;
+
+/*
+ * Narrows brightest and faintest to the magnitudes the filter ending at
+ * end admits, as far as comparisons of mag joined by && tell.
+ */
+static
+void
+magnitudeRange(double* brightest, double* faintest, std::vector<FilterOp> const& program, size_t end)
+{
+	auto const& op = program[end - 1];
+	if (op.kind == FilterOp::AND) {
+		magnitudeRange(brightest, faintest, program, end - 1);
+		magnitudeRange(brightest, faintest, program, filterStart(program, end - 1));
+	}
+	else if (op.kind == FilterOp::COMPARE && op.column == COLUMN_MAG) {
+		if (op.compare == FilterOp::LT || op.compare == FilterOp::LE || op.compare == FilterOp::EQ) {
+			*faintest = std::min(*faintest, op.value);
+		}
+		if (op.compare == FilterOp::GT || op.compare == FilterOp::GE || op.compare == FilterOp::EQ) {
+			*brightest = std::max(*brightest, op.value);
+		}
+	}
+}
+
+/*
+ * The stars selected by the filters asked for lately, shared by all
+ * connections, so that a filter sent again costs no pass over the table.
+ */
+class SelectionCache {
+public:
+	Selection
+	find(std::string const& text)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->first == text) {
+				auto const entry = *it;
+				entries.erase(it);
+				entries.push_front(entry);
+				return entry.second;
+			}
+		}
+		return Selection();
+	}
+
+	void
+	add(std::string const& text, Selection const& selection)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.push_front(std::make_pair(text, selection));
+		if (entries.size() > SERVE_CACHED_FILTERS) {
+			entries.pop_back();
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::deque<std::pair<std::string, Selection>> entries;	// latest first
+};
+
+struct Catalog {
+	Header header;
+	std::shared_ptr<void const> mapping;	// of the file, holding the records
+	unsigned char const* records;
+	StarTable table;
+	std::vector<std::uint64_t> served;	// one bit per star, as in a filter mask
+	std::vector<std::uint32_t> byId;
+	std::vector<std::uint32_t> byMagnitude;
+	std::vector<std::uint32_t> byDeclination;
+	std::vector<double> declinations;	// in byDeclination order
+	mutable SelectionCache selections;
+};
+
+static
+bool
+isServed(Catalog const& catalog, std::uint32_t const row)
+{
+	return (catalog.served[row/64] >> (row%64)) & 1;
+}
+
+static
+void
+buildCatalog(Catalog* catalog, Options const& options)
+{
+	auto const& header = catalog->header;
+	auto const layout = recordLayout(header);
+	auto& table = catalog->table;
+	decodeAllColumns(&table, header, layout, catalog->records, header.numStars,
+			 ~0u, (1u << header.numMagnitudes) - 1, [](int, int) { return 0; });
+
+	{
+		PhaseTimer timer(PHASE_FILTER, 0, header.numStars);
+		std::vector<std::uint64_t> stack;
+		evaluateFilter(&catalog->served, &stack, options.filter, table, header.starNameLength);
+		if (options.spectralFilter) {
+			for (auto i = 0; i < header.numStars; ++i) {
+				auto const c = (unsigned char)table.spectralType[2*i];
+				if (!((options.spectralClasses[c/64] >> (c%64)) & 1)) {
+					catalog->served[i/64] &= ~((std::uint64_t)1 << (i%64));
+				}
+			}
+		}
+	}
+
+	PhaseTimer timer(PHASE_SORT, 0, header.numStars);
+	std::vector<std::uint32_t> rows;
+	for (auto i = 0; i < header.numStars; ++i) {
+		if (isServed(*catalog, i)) {
+			rows.push_back(i);
+		}
+	}
+	catalog->byId = rows;
+	std::stable_sort(catalog->byId.begin(), catalog->byId.end(), [&](std::uint32_t a, std::uint32_t b) {
+		return table.starId[a] < table.starId[b];
+	});
+	catalog->byMagnitude = rows;
+	// Stars without a magnitude go last, so the order stays one to
+	// binary search.
+	std::stable_sort(catalog->byMagnitude.begin(), catalog->byMagnitude.end(), [&](std::uint32_t a, std::uint32_t b) {
+		auto const x = table.magnitude[a];
+		auto const y = table.magnitude[b];
+		return x < y || (!std::isnan(x) && std::isnan(y));
+	});
+	catalog->byDeclination = rows;
+	std::stable_sort(catalog->byDeclination.begin(), catalog->byDeclination.end(), [&](std::uint32_t a, std::uint32_t b) {
+		return table.declination[a] < table.declination[b];
+	});
+	catalog->declinations.resize(rows.size());
+	for (size_t i = 0; i < rows.size(); ++i) {
+		catalog->declinations[i] = table.declination[catalog->byDeclination[i]];
+	}
+}
+
+static
+int
+readSocket(int const fd, void* data, size_t size)
+{
+	auto p = (char*)data;
+	while (size > 0) {
+		auto const n = ::read(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static
+int
+writeSocket(int const fd, void const* data, size_t size)
+{
+	auto p = (char const*)data;
+	while (size > 0) {
+		auto const n = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Answers one request, leaving the response in out.
+ */
+class ServeSession {
+public:
+	explicit ServeSession(Catalog const& catalog)
+	    : catalog(catalog)
+	{
+	}
+
+	void
+	answer(std::string* out, unsigned char const* request, size_t const size)
+	{
+		out->assign(3*sizeof(std::uint32_t), '\0');
+		count = 0;
+		this->out = out;
+		auto ok = false;
+		if (size > 0) {
+			this->request = request + 1;
+			this->size = size - 1;
+			ok = dispatch(request[0]);
+		}
+		if (!ok) {
+			out->resize(3*sizeof(std::uint32_t));
+			out->append(error.empty() ? "malformed request" : error);
+			count = 0;
+		}
+		std::uint32_t const response[3] = {
+			ok ? 0u : 1u, count, (std::uint32_t)(out->size() - sizeof response)
+		};
+		std::memcpy(&(*out)[0], response, sizeof response);
+		error.clear();
+	}
+
+private:
+	bool
+	dispatch(int const op)
+	{
+		switch (op) {
+		case SERVE_ID:
+			return byId();
+		case SERVE_CONE:
+			return cone();
+		case SERVE_TOP:
+			return top();
+		case SERVE_FILTER:
+			return filter();
+		}
+		error = "unknown request";
+		return false;
+	}
+
+	template <typename T>
+	bool
+	take(T* value)
+	{
+		if (size < sizeof(T)) {
+			return false;
+		}
+		std::memcpy(value, request, sizeof(T));
+		request += sizeof(T);
+		size -= sizeof(T);
+		return true;
+	}
+
+	void
+	add(std::uint32_t const row)
+	{
+		auto const stride = (size_t)catalog.header.numBytesPerStar;
+		out->append((char const*)catalog.records + row*stride, stride);
+		++count;
+	}
+
+	bool
+	byId()
+	{
+		double id;
+		if (!take(&id) || size != 0) {
+			return false;
+		}
+		auto const& starId = catalog.table.starId;
+		auto const it = std::lower_bound(catalog.byId.begin(), catalog.byId.end(), id,
+		    [&](std::uint32_t row, double value) {
+			return starId[row] < value;
+		});
+		for (auto i = it; i != catalog.byId.end() && starId[*i] == id; ++i) {
+			add(*i);
+		}
+		return true;
+	}
+
+	bool
+	cone()
+	{
+		double ra, dec, radius;
+		std::uint32_t limit;
+		if (!take(&ra) || !take(&dec) || !take(&radius) || !take(&limit) || size != 0) {
+			return false;
+		}
+		auto const& table = catalog.table;
+		auto const& declinations = catalog.declinations;
+		auto const first = std::lower_bound(declinations.begin(), declinations.end(), dec - radius);
+		auto const last = std::upper_bound(first, declinations.end(), dec + radius);
+		auto const sinDec = std::sin(dec);
+		auto const cosDec = std::cos(dec);
+		auto const cosRadius = std::cos(radius);
+		for (auto i = first; i != last && count < limit; ++i) {
+			auto const row = catalog.byDeclination[i - declinations.begin()];
+			auto const d = table.declination[row];
+			auto const cosDistance = sinDec*std::sin(d) +
+			    cosDec*std::cos(d)*std::cos(table.rightAscension[row] - ra);
+			if (cosDistance >= cosRadius) {
+				add(row);
+			}
+		}
+		return true;
+	}
+
+	bool
+	top()
+	{
+		std::uint32_t k;
+		if (!take(&k) || !compile()) {
+			return false;
+		}
+		auto const& magnitude = catalog.table.magnitude;
+		auto const& byMagnitude = catalog.byMagnitude;
+		auto const brightest = std::partition_point(byMagnitude.begin(), byMagnitude.end(),
+		    [&](std::uint32_t row) {
+			return magnitude[row] < selection->brightest;
+		});
+		for (auto i = brightest; i != byMagnitude.end() && count < k; ++i) {
+			if (magnitude[*i] > selection->faintest) {
+				break;
+			}
+			if (matches(*i)) {
+				add(*i);
+			}
+		}
+		return true;
+	}
+
+	bool
+	filter()
+	{
+		std::uint32_t limit;
+		if (!take(&limit) || !compile()) {
+			return false;
+		}
+		auto const& mask = selection->mask;
+		for (size_t w = 0; w < mask.size(); ++w) {
+			for (auto bits = mask[w]; bits && count < limit; bits &= bits - 1) {
+				add(64*w + __builtin_ctzll(bits));
+			}
+		}
+		return true;
+	}
+
+	// Selects the served stars matching the rest of the request as a
+	// filter expression, from the cache if it was asked for lately.
+	bool
+	compile()
+	{
+		auto const text = std::string((char const*)request, size);
+		selection = catalog.selections.find(text);
+		if (selection) {
+			return true;
+		}
+		if (compileFilter(&program, text, DBL_MAX, &error) != 0) {
+			return false;
+		}
+		if (program.bands >> catalog.header.numMagnitudes) {
+			error.clear();
+			appendf(&error, "filter: magnitude band out of range, catalog has %d",
+				catalog.header.numMagnitudes);
+			return false;
+		}
+		auto const selected = std::make_shared<Selected>();
+		auto& mask = selected->mask;
+		evaluateFilter(&mask, &stack, program, catalog.table, catalog.header.starNameLength);
+		for (size_t w = 0; w < mask.size(); ++w) {
+			mask[w] &= catalog.served[w];
+		}
+		selected->brightest = -HUGE_VAL;
+		selected->faintest = HUGE_VAL;
+		magnitudeRange(&selected->brightest, &selected->faintest, program.program, program.program.size());
+		selection = selected;
+		catalog.selections.add(text, selection);
+		return true;
+	}
+
+	bool
+	matches(std::uint32_t const row) const
+	{
+		return (selection->mask[row/64] >> (row%64)) & 1;
+	}
+
+	Catalog const& catalog;
+	std::string* out;
+	unsigned char const* request;
+	size_t size;
+	std::uint32_t count;
+	std::string error;
+	Filter program;
+	Selection selection;
+	std::vector<std::uint64_t> stack;
+};
+
+static
+int
+serve(
+    char const* const socketPath,
+    char const* const inputfile,
+    size_t const filesize,
+    Header const& header,
+    Options const& options)
+{
+#if defined(__unix__)
+	auto const fd = open(inputfile, O_RDONLY);
+	if (fd < 0) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", inputfile);
+		return -1;
+	}
+	auto const mapping = mmap(nullptr, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		std::fprintf(stderr, "sidus: %s: failed to map file\n", inputfile);
+		return -1;
+	}
+#if defined(__linux__)
+	if (hugePages) {
+		madvise(mapping, filesize, MADV_HUGEPAGE);
+	}
+#endif
+
+	Catalog catalog;
+	catalog.header = header;
+	catalog.mapping.reset(mapping, [filesize](void const* p) {
+		munmap((void*)p, filesize);
+	});
+	catalog.records = (unsigned char const*)mapping + 28;
+	buildCatalog(&catalog, options);
+
+	struct sockaddr_un address;
+	std::memset(&address, 0, sizeof address);
+	address.sun_family = AF_UNIX;
+	if (std::strlen(socketPath) >= sizeof address.sun_path) {
+		std::fprintf(stderr, "sidus: %s: socket path too long\n", socketPath);
+		return -1;
+	}
+	std::strcpy(address.sun_path, socketPath);
+	auto const listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		std::fprintf(stderr, "sidus: failed to create socket\n");
+		return -1;
+	}
+	unlink(socketPath);
+	if (bind(listener, (struct sockaddr const*)&address, sizeof address) != 0 ||
+	    listen(listener, 64) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to listen\n", socketPath);
+		close(listener);
+		return -1;
+	}
+	std::fprintf(stderr, "sidus: serving %zu stars on %s\n", catalog.byId.size(), socketPath);
+
+	// A connection is served by one of as many threads as --threads asks
+	// for; further connections wait until one of them is done.
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::condition_variable idle;
+	std::deque<int> pending;
+	std::vector<int> clients(options.numThreads, -1);
+	auto stop = false;
+	std::vector<std::thread> connections;
+	for (auto i = 0; i < options.numThreads; ++i) {
+		connections.emplace_back([&, i] {
+			ServeSession session(catalog);
+			std::vector<unsigned char> request;
+			std::string response;
+			for (;;) {
+				int client;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					ready.wait(lock, [&] { return stop || !pending.empty(); });
+					if (stop) {
+						return;
+					}
+					client = pending.front();
+					pending.pop_front();
+					clients[i] = client;
+				}
+				idle.notify_one();
+				std::uint32_t size;
+				while (readSocket(client, &size, sizeof size) == 0 && size <= SERVE_MAX_REQUEST) {
+					request.resize(size);
+					if (readSocket(client, request.data(), size) != 0) {
+						break;
+					}
+					session.answer(&response, request.data(), size);
+					if (writeSocket(client, response.data(), response.size()) != 0) {
+						break;
+					}
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				close(client);
+				clients[i] = -1;
+			}
+		});
+	}
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [&] { return pending.empty(); });
+		}
+		auto const client = accept(listener, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			std::fprintf(stderr, "sidus: %s: failed to accept\n", socketPath);
+			break;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending.push_back(client);
+		}
+		ready.notify_one();
+	}
+
+	// Cuts the connections still served short, so that their threads can
+	// be joined.
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		for (auto const client : pending) {
+			close(client);
+		}
+		for (auto const client : clients) {
+			if (client >= 0) {
+				shutdown(client, SHUT_RDWR);
+			}
+		}
+	}
+	ready.notify_all();
+	for (auto& connection : connections) {
+		connection.join();
+	}
+	close(listener);
+	return -1;
+#else
+	(void)inputfile;
+	(void)filesize;
+	(void)header;
+	(void)options;
+	std::fprintf(stderr, "sidus: %s: --serve needs Unix domain sockets\n", socketPath);
+	return -1;
+#endif
+}
+
+/*
+ * --watch: converts into an output file, then waits for the input to be
+ * rewritten and converts it again.  The records and stars of the last run
+ * are kept, so only records whose bytes changed are decoded again, only
+ * chunks holding such records are formatted again, and only the blocks
+ * of the output file that differ are written.  Sorted output is sorted and
+ * formatted in full each time, as any star may move.
+ */
+struct WatchState {
+	Header header;			// as first seen; only numStars may change
+	PageVector<unsigned char> file;	// as last converted
+	std::vector<Star> stars;	// one per record, valid where kept
+	std::vector<char> names;	// starNameLength + 1 per record, for stars
+	std::vector<char> kept;		// passed the filters
+	std::vector<std::string> texts;	// per chunk, when output is unsorted
+	std::unique_ptr<DecodeScratch[]> scratch;
+	std::string output;		// as in the output file
+};
+
+static
+void
+redecode(
+    WatchState* state,
+    DecodeScratch* scratch,
+    unsigned char const* const records,
+    std::vector<std::uint32_t> const& changed,
+    Header const& header,
+    Options const& options)
+{
+	auto const layout = recordLayout(header);
+	auto const stride = (size_t)header.numBytesPerStar;
+	auto const length = (size_t)header.starNameLength;
+	auto& rows = scratch->rows;
+	rows.clear();
+	for (auto const row : changed) {
+		state->kept[row] = false;
+		auto const c = records[row*stride + layout.spectralType];
+		if (!options.spectralFilter || ((options.spectralClasses[c/64] >> (c%64)) & 1)) {
+			rows.push_back(row);
+		}
+	}
+	decodeColumns(&scratch->table, header, layout, records, rows.data(), rows.size(),
+		      options.filter.columns, options.filter.bands);
+	evaluateFilter(&scratch->mask, &scratch->stack, options.filter, scratch->table, header.starNameLength);
+	auto const& mask = scratch->mask;
+	for (size_t w = 0; w < mask.size(); ++w) {
+		for (auto bits = mask[w]; bits; bits &= bits - 1) {
+			auto const row = rows[64*w + __builtin_ctzll(bits)];
+			auto& star = state->stars[row];
+			if (parseStar(&star, header, records + row*stride, &scratch->names) == 0) {
+				state->kept[row] = true;
+				if (length > 0) {
+					auto const name = &state->names[row*(length + 1)];
+					std::memcpy(name, star.name, length + 1);
+					star.name = name;
+				}
+			}
+		}
+	}
+}
+
+static size_t const WATCH_BLOCK_SIZE = 4096;
+
+/*
+ * Writes output over previous, which is what the file holds, touching
+ * only the blocks of WATCH_BLOCK_SIZE that differ, each run of them with
+ * a write of its own, and whatever lies past the end of previous.
+ */
+static
+int
+updateFile(char const* const outputfile, std::string const& previous, std::string const& output, size_t* written)
+{
+#if defined(__unix__)
+	auto const fd = open(outputfile, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	auto const common = std::min(previous.size(), output.size());
+	auto differs = [&](size_t const block) {
+		if (block >= common) {
+			return block < output.size();
+		}
+		auto const n = std::min(WATCH_BLOCK_SIZE, output.size() - block);
+		return n != std::min(WATCH_BLOCK_SIZE, previous.size() - block) ||
+		    std::memcmp(previous.data() + block, output.data() + block, n) != 0;
+	};
+	*written = 0;
+	auto rv = 0;
+	for (size_t block = 0; block < output.size() && rv == 0;) {
+		if (!differs(block)) {
+			block += WATCH_BLOCK_SIZE;
+			continue;
+		}
+		auto const first = block;
+		while (block < output.size() && differs(block)) {
+			block += WATCH_BLOCK_SIZE;
+		}
+		auto const last = std::min(block, output.size());
+		*written += last - first;
+		for (auto offset = first; offset < last && rv == 0;) {
+			auto const n = pwrite(fd, output.data() + offset, last - offset, offset);
+			if (n < 0 && errno != EINTR) {
+				rv = -1;
+			}
+			offset += std::max<ssize_t>(n, 0);
+		}
+	}
+	if (rv == 0 && ftruncate(fd, output.size()) != 0) {
+		rv = -1;
+	}
+	if (close(fd) != 0) {
+		rv = -1;
+	}
+	return rv;
+#else
+	(void)outputfile;
+	(void)previous;
+	(void)output;
+	(void)written;
+	return -1;
+#endif
+}
+
+static
+int
+reconvert(
+    WatchState* state,
+    char const* const inputfile,
+    char const* const outputfile,
+    Options const& options)
+{
+	size_t filesize = 0;
+	FILE* f = nullptr;
+	if (getFileSize(&filesize, inputfile) != 0 || !(f = fopen(inputfile, "rb"))) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", inputfile);
+		return -1;
+	}
+	PageVector<unsigned char> file(filesize);
+	auto const status = filesize < 28 ? -1 : readFully(f, file.data(), filesize);
+	fclose(f);
+	if (status != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+		return -1;
+	}
+
+	auto const& first = state->header;
+	auto header = first;
+	if (parseHeader(&header, file.data(), first.epoch,
+			first.littleEndian ? Endian::LITTLE : Endian::BIG) != 0) {
+		return -1;
+	}
+	header.apparentMagnitude = first.apparentMagnitude;
+	if (header.starId != first.starId || header.starNameLength != first.starNameLength ||
+	    header.properMotion != first.properMotion || header.numMagnitudes != first.numMagnitudes ||
+	    header.numBytesPerStar != first.numBytesPerStar) {
+		std::fprintf(stderr, "sidus: %s: record format changed, restart to convert\n", inputfile);
+		return -1;
+	}
+	auto const stride = (size_t)header.numBytesPerStar;
+	if (filesize < 28 + (size_t)header.numStars*stride) {
+		std::fprintf(stderr, "sidus: %s: file too short\n", inputfile);
+		return -1;
+	}
+
+	auto const oldNumStars = state->file.empty() ? 0 : (int)((state->file.size() - 28)/stride);
+	auto const numStars = header.numStars;
+	auto const numChunks = (numStars + CHUNK_STARS - 1)/CHUNK_STARS;
+	state->stars.resize(numStars);
+	state->kept.resize(numStars, false);
+	state->texts.resize(numChunks);
+
+	// Kept stars have their names in state->names, so the arenas that
+	// parseStar() fills are only needed for this run; the names move
+	// along if state->names has to grow.
+	auto const length = (size_t)header.starNameLength;
+	auto const names = state->names.data();
+	state->names.resize((size_t)numStars*(length + 1));
+	if (length > 0 && state->names.data() != names) {
+		for (auto row = 0; row < std::min(oldNumStars, numStars); ++row) {
+			if (state->kept[row]) {
+				state->stars[row].name = &state->names[row*(length + 1)];
+			}
+		}
+	}
+	for (auto slot = 0; slot < pool.size(); ++slot) {
+		state->scratch[slot].names.clear();
+	}
+
+	auto const records = file.data() + 28;
+	auto const oldRecords = state->file.data() + 28;
+	std::atomic<int> numChanged(0);
+	pool.parallelFor(numChunks, [&](size_t const c) {
+		auto const begin = (int)c*CHUNK_STARS;
+		auto const end = std::min(begin + CHUNK_STARS, numStars);
+		std::vector<std::uint32_t> changed;
+		for (auto row = begin; row < end; ++row) {
+			if (row >= oldNumStars ||
+			    std::memcmp(records + row*stride, oldRecords + row*stride, stride) != 0) {
+				changed.push_back(row);
+			}
+		}
+		auto const oldEnd = std::max(begin, std::min(begin + CHUNK_STARS, oldNumStars));
+		if (changed.empty() && end == oldEnd) {
+			return;
+		}
+		numChanged += changed.size();
+		{
+			PhaseTimer timer(PHASE_DECODE, changed.size()*stride, changed.size());
+			redecode(state, &state->scratch[pool.slot()], records, changed, header, options);
+		}
+		if (options.sort.empty()) {
+			std::vector<Star> stars;
+			for (auto row = begin; row < end; ++row) {
+				if (state->kept[row]) {
+					stars.push_back(state->stars[row]);
+				}
+			}
+			formatStars(&state->texts[c], stars, header, options.format);
+		}
+	});
+	state->file.swap(file);
+
+	std::string text;
+	std::string culling;
+	size_t numWritten = 0;
+	if (!options.sort.empty()) {
+		std::vector<Star> sorted;
+		for (auto row = 0; row < numStars; ++row) {
+			if (state->kept[row]) {
+				sorted.push_back(state->stars[row]);
+			}
+		}
+		numWritten = formatSorted(&text, &culling, &sorted, inputfile, header, options);
+	} else {
+		for (auto c = 0; c < numChunks; ++c) {
+			if (!state->texts[c].empty()) {
+				if (options.format.cformat && !text.empty()) {
+					text.append(", ");
+				}
+				text.append(state->texts[c]);
+			}
+		}
+		for (auto row = 0; row < numStars; ++row) {
+			numWritten += state->kept[row];
+		}
+	}
+
+	std::string output;
+	if (options.format.cformat) {
+		printCHeader(&output, inputfile, numWritten, header.epoch, options.format);
+	}
+	output.append(text);
+	if (options.format.cformat) {
+		printCFooter(&output, culling);
+	}
+
+	size_t written = 0;
+	{
+		PhaseTimer timer(PHASE_OUTPUT);
+		if (updateFile(outputfile, state->output, output, &written) != 0) {
+			std::fprintf(stderr, "sidus: %s: failed to write file\n", outputfile);
+			state->output.clear();
+			return -1;
+		}
+	}
+	state->output.swap(output);
+	std::fprintf(stderr, "sidus: %s: %d of %d records changed, %zu bytes written\n",
+		     inputfile, numChanged.load(), numStars, written);
+	return 0;
+}
+
+static
+int
+watch(
+    char const* const outputfile,
+    char const* const inputfile,
+    Header const& header,
+    Options const& options)
+{
+	WatchState state;
+	state.header = header;
+	state.scratch.reset(new DecodeScratch[pool.size()]);
+	if (reconvert(&state, inputfile, outputfile, options) != 0) {
+		return -1;
+	}
+	if (profile.enabled) {
+		printProfile(stderr);
+	}
+
+#if defined(__linux__)
+	// Editors and generators often replace the file, so the directory
+	// is watched rather than the file itself.
+	auto const path = std::string(inputfile);
+	auto const slash = path.find_last_of('/');
+	auto const directory = slash == std::string::npos ? std::string(".") :
+	    slash == 0 ? std::string("/") : path.substr(0, slash);
+	auto const name = slash == std::string::npos ? path : path.substr(slash + 1);
+	auto const fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		std::fprintf(stderr, "sidus: %s: failed to watch\n", directory.c_str());
+		return -1;
+	}
+	alignas(struct inotify_event) char buf[4096];
+	for (;;) {
+		auto const n = ::read(fd, buf, sizeof buf);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			std::fprintf(stderr, "sidus: %s: failed to watch\n", directory.c_str());
+			break;
+		}
+		auto changed = false;
+		for (auto p = buf; p < buf + n;) {
+			auto const event = (struct inotify_event const*)p;
+			changed |= event->len > 0 && name == event->name;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		if (changed) {
+			reconvert(&state, inputfile, outputfile, options);
+		}
+	}
+	close(fd);
+	return -1;
+#else
+	std::fprintf(stderr, "sidus: --watch needs inotify\n");
+	return -1;
+#endif
+}
+
+/*
+ * --diff: the stars of two catalogs are paired up by star id, through a
+ * hash table over the new one, or by index, and their fields compared
+ * within the given tolerances.  Workers take ranges of records, each
+ * writing its part of the report, which is printed in order: removed and
+ * changed stars in the order of the old catalog, then added stars in the
+ * order of the new one.
+ */
+enum DiffField {
+	DIFF_RA,
+	DIFF_DEC,
+	DIFF_MAG,	// all bands
+	DIFF_PMRA,
+	DIFF_PMDEC,
+	DIFF_RV,
+	NUM_DIFF_FIELDS
+};
+
+static char const* const diffFieldNames[NUM_DIFF_FIELDS] = {
+	"ra", "dec", "mag", "pmra", "pmdec", "rv"
+};
+
+struct DiffOptions {
+	bool byIndex;
+	double tolerance[NUM_DIFF_FIELDS];
+};
+
+static int const DIFF_RANGE = 1 << 16;
+
+static
+int
+parseTolerances(double* tolerance, std::string const& spec)
+{
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		auto end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		auto const item = spec.substr(begin, end - begin);
+		auto const equals = item.find('=');
+		auto field = 0;
+		while (field < NUM_DIFF_FIELDS && item.compare(0, equals, diffFieldNames[field]) != 0) {
+			++field;
+		}
+		char* rest = nullptr;
+		auto const value = equals == std::string::npos ? 0.0 :
+		    std::strtod(item.c_str() + equals + 1, &rest);
+		if (field == NUM_DIFF_FIELDS || !rest || *rest || rest == item.c_str() + equals + 1 ||
+		    value < 0.0) {
+			std::fprintf(stderr, "sidus: invalid tolerance '%s'\n", item.c_str());
+			return -1;
+		}
+		tolerance[field] = value;
+		begin = end + 1;
+	}
+	return 0;
+}
+
+struct DiffCatalog {
+	Header header;
+	PageVector<unsigned char> records;
+	StarTable table;
+};
+
+static
+int
+loadDiffCatalog(DiffCatalog* catalog, char const* const path, Header const* header)
+{
+	size_t filesize = 0;
+	FILE* f = nullptr;
+	if (getFileSize(&filesize, path) != 0 || !(f = fopen(path, "rb"))) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", path);
+		return -1;
+	}
+	std::unique_ptr<FILE, int (*)(FILE*)> file(f, fclose);
+	unsigned char raw[28];
+	if (filesize < sizeof raw || readFully(f, raw, sizeof raw) != 0) {
+		std::fprintf(stderr, "sidus: %s: no header\n", path);
+		return -1;
+	}
+	if (header) {
+		catalog->header = *header;
+	}
+	else if (parseHeader(&catalog->header, raw, Epoch::AUTO, Endian::AUTO) != 0) {
+		return -1;
+	} else {
+		catalog->header.apparentMagnitude = catalog->header.numMagnitudes - 1;
+	}
+	auto const& h = catalog->header;
+	auto const layout = recordLayout(h);
+	if (h.numBytesPerStar < layout.size || h.numMagnitudes < 1) {
+		std::fprintf(stderr, "sidus: %s: invalid header\n", path);
 		return -1;
 	}
-
-	auto const isJ2000 = starn < 0 || nmag < 0;
-	if (epoch == Epoch::J2000 && !isJ2000) {
-		std::fprintf(stderr, "sidus: expected J2000 epoch but found B1950 epoch\n");
+	auto const size = (size_t)h.numStars*h.numBytesPerStar;
+	if (filesize < sizeof raw + size) {
+		std::fprintf(stderr, "sidus: %s: file too short\n", path);
 		return -1;
 	}
-	else if (epoch == Epoch::B1950 && isJ2000) {
-		std::fprintf(stderr, "sidus: expected B1950 epoch but found J2000 epoch\n");
+	// Each range is read by the task that decodes it.
+	catalog->records.resize(size);
+	auto const records = catalog->records.data();
+	auto const stride = (size_t)h.numBytesPerStar;
+	auto read = [&](int const begin, int const end) {
+		auto const bytes = (end - begin)*stride;
+		PhaseTimer timer(PHASE_READ, bytes, end - begin);
+		return readAt(f, (long)(sizeof raw + begin*stride), records + begin*stride, bytes);
+	};
+	if (decodeAllColumns(&catalog->table, h, layout, records, h.numStars,
+			     ~0u, (1u << h.numMagnitudes) - 1, read) != 0) {
+		std::fprintf(stderr, "sidus: %s: failed to read file\n", path);
 		return -1;
 	}
-
-	header->numStars = std::abs(starn);
-	header->starId = stnum < 0 ? Header::NO_STAR_ID : (Header::StarId)stnum;
-	header->starNameLength = stnum < 0 ? -stnum : 0;
-	header->properMotion = (Header::ProperMotion)mprop;
-	header->numMagnitudes = std::abs(nmag);
-	header->numBytesPerStar = nbent;
-	header->epoch = isJ2000 ? Epoch::J2000 : Epoch::B1950;
-	header->littleEndian = littleEndian;
-
 	return 0;
 }
 
 static
-int
-parseStar(
-    Star* star,
-    Header const& header,
-    unsigned char const* const data)
+void
+appendKey(std::string* out, DiffCatalog const& catalog, int const row, bool const byIndex)
 {
-	auto const littleEndian = header.littleEndian;
-	auto cursor = 0;
-
-	double xno = 0.0;
-	if (header.starId == Header::CATALOG_STAR_ID ||
-	    header.starId == Header::GSC_STAR_ID ||
-	    header.starId == Header::TYCHO_STAR_ID) {
-		float xno2;
-		parse(&xno2, data + cursor, littleEndian);
-		xno = xno2;
-		cursor += 4;
-	}
-        else if (header.starId == Header::INTEGER_STAR_ID) {
-		std::int32_t xno2;
-		parse(&xno2, data + cursor, littleEndian);
-		xno = xno2;
-		cursor += 4;
+	if (byIndex) {
+		appendf(out, "#%d", row);
+	} else {
+		appendf(out, "%.10g", catalog.table.starId[row]);
 	}
+}
 
-	double ra;
-	parse(&ra, data + cursor, littleEndian);
-	cursor += 8;
-	double decl;
-	parse(&decl, data + cursor, littleEndian);
-	cursor += 8;
-	char isp[2];
-	isp[0] = *(data + cursor++);
-	isp[1] = *(data + cursor++);
-	std::int16_t mag;
-	for (auto i = 0; i < header.numMagnitudes; ++i, cursor += 2) {
-		if (i == header.apparentMagnitude) {
-			parse(&mag, data + cursor, littleEndian);
+/*
+ * Appends the fields of a and b that differ, returning whether any do.
+ * Two NaNs count as equal.  Paired by index, the ids are compared too.
+ */
+static
+bool
+diffStars(
+    std::string* out,
+    DiffCatalog const& a,
+    int const i,
+    DiffCatalog const& b,
+    int const j,
+    DiffOptions const& options)
+{
+	auto const& ta = a.table;
+	auto const& tb = b.table;
+	auto const begin = out->size();
+	auto const compare = [&](char const* name, DiffField field, double x, double y) {
+		if (!(std::fabs(x - y) <= options.tolerance[field]) &&
+		    !(std::isnan(x) && std::isnan(y))) {
+			appendf(out, " %s %.17g %.17g", name, x, y);
+		}
+	};
+	if (options.byIndex &&
+	    a.header.starId != Header::NO_STAR_ID && b.header.starId != Header::NO_STAR_ID) {
+		auto const x = ta.starId[i];
+		auto const y = tb.starId[j];
+		if (x != y && !(std::isnan(x) && std::isnan(y))) {
+			appendf(out, " id %.17g %.17g", x, y);
 		}
 	}
-	float xrpm = 0.0f;
-	float xdpm = 0.0f;
-	double svel = 0.0;
-	if (header.properMotion == Header::PROPER_MOTION) {
-		parse(&xrpm, data + cursor, littleEndian);
-		cursor += 4;
-		parse(&xdpm, data + cursor, littleEndian);
-		cursor += 4;
+	compare("ra", DIFF_RA, ta.rightAscension[i], tb.rightAscension[j]);
+	compare("dec", DIFF_DEC, ta.declination[i], tb.declination[j]);
+	auto const numMagnitudes = std::min(a.header.numMagnitudes, b.header.numMagnitudes);
+	for (auto band = 0; band < numMagnitudes; ++band) {
+		char name[8];
+		std::snprintf(name, sizeof name, "mag%d", band);
+		compare(name, DIFF_MAG, ta.magnitudes[band][i], tb.magnitudes[band][j]);
 	}
-	else if (header.properMotion == Header::RADIAL_VELOCITY) {
-		parse(&svel, data + cursor, littleEndian);
-		cursor += 8;
+	if (a.header.properMotion == b.header.properMotion) {
+		if (a.header.properMotion == Header::PROPER_MOTION) {
+			compare("pmra", DIFF_PMRA, ta.properMotionRA[i], tb.properMotionRA[j]);
+			compare("pmdec", DIFF_PMDEC, ta.properMotionDec[i], tb.properMotionDec[j]);
+		}
+		else if (a.header.properMotion == Header::RADIAL_VELOCITY) {
+			compare("rv", DIFF_RV, ta.radialVelocity[i], tb.radialVelocity[j]);
+		}
 	}
-	char starname[header.starNameLength + 1];
-	if (header.starNameLength > 0) {
-		std::strncpy(starname, (char const*)(data + cursor), header.starNameLength);
+	auto const spectralA = &ta.spectralType[2*i];
+	auto const spectralB = &tb.spectralType[2*j];
+	if (spectralA[0] != spectralB[0] || spectralA[1] != spectralB[1]) {
+		appendf(out, " spectral \"%.2s\" \"%.2s\"", spectralA, spectralB);
 	}
-	starname[header.starNameLength] = '\0';
-
-	star->name = starname;
-	star->rightAscension = ra;
-	star->declination = decl;
-	star->starId = xno;
-	star->magnitude = (float)(mag)/100.0f;
-	star->properMotion.rightAscension = xrpm;
-	star->properMotion.declination = xdpm;
-	star->radialVelocity = svel;
-	star->spectralType[0] = isp[0];
-	star->spectralType[1] = isp[1];
-	star->spectralType[2] = '\0';
-
-	return 0;
+	if (a.header.starNameLength > 0 && b.header.starNameLength > 0) {
+		auto const nameA = &ta.name[(size_t)i*(a.header.starNameLength + 1)];
+		auto const nameB = &tb.name[(size_t)j*(b.header.starNameLength + 1)];
+		if (std::strcmp(nameA, nameB) != 0) {
+			appendf(out, " name \"%s\" \"%s\"", nameA, nameB);
+		}
+	}
+	return out->size() != begin;
 }
 
 static
-std::string
-sanitizeForC(char const * cs)
+int
+diff(
+    char const* const oldfile,
+    char const* const newfile,
+    Header const& header,
+    DiffOptions options)
 {
-	std::string s;
-	for (auto i = 0u; cs[i]; ++i) {
-		auto const c = std::tolower(cs[i]);
-		if (i == 0) {
-			if (isalpha(c)) {
-				s.push_back(c);
-			} else {
-				s.push_back('x');
+	DiffCatalog a;
+	DiffCatalog b;
+	if (loadDiffCatalog(&a, oldfile, nullptr) != 0 ||
+	    loadDiffCatalog(&b, newfile, &header) != 0) {
+		return -1;
+	}
+	if (!options.byIndex &&
+	    (a.header.starId == Header::NO_STAR_ID || b.header.starId == Header::NO_STAR_ID)) {
+		options.byIndex = true;
+	}
+
+	// Ids of the new catalog, and of the old one to find added stars;
+	// where an id repeats the first star with it is used.
+	std::unordered_map<double, int> idsA;
+	std::unordered_map<double, int> idsB;
+	if (!options.byIndex) {
+		PhaseTimer timer(PHASE_SORT, 0, a.header.numStars + b.header.numStars);
+		pool.parallelFor(2, [&](size_t const which) {
+			auto& ids = which == 0 ? idsA : idsB;
+			auto const& catalog = which == 0 ? a : b;
+			ids.reserve(catalog.header.numStars);
+			for (auto i = 0; i < catalog.header.numStars; ++i) {
+				ids.emplace(catalog.table.starId[i], i);
+			}
+		});
+	}
+
+	auto const numRangesA = (a.header.numStars + DIFF_RANGE - 1)/DIFF_RANGE;
+	auto const numRangesB = (b.header.numStars + DIFF_RANGE - 1)/DIFF_RANGE;
+	std::vector<std::string> reports(numRangesA + numRangesB);
+	std::atomic<size_t> numRemoved(0);
+	std::atomic<size_t> numChanged(0);
+	std::atomic<size_t> numAdded(0);
+	auto const work = [&](size_t const index) {
+		auto const r = (int)index;
+		std::string line;
+		auto& out = reports[r];
+		if (r < numRangesA) {
+			auto const end = std::min(a.header.numStars, (r + 1)*DIFF_RANGE);
+			for (auto i = r*DIFF_RANGE; i < end; ++i) {
+				auto j = i;
+				if (!options.byIndex) {
+					auto const it = idsB.find(a.table.starId[i]);
+					j = it == idsB.end() ? -1 : it->second;
+				}
+				if (j < 0 || j >= b.header.numStars) {
+					out.append("- ");
+					appendKey(&out, a, i, options.byIndex);
+					out.append("\n");
+					++numRemoved;
+					continue;
+				}
+				line.clear();
+				if (diffStars(&line, a, i, b, j, options)) {
+					out.append("~ ");
+					appendKey(&out, a, i, options.byIndex);
+					out.append(line);
+					out.append("\n");
+					++numChanged;
+				}
 			}
 		} else {
-			if (isalnum(c)) {
-				s.push_back(c);
-			} else {
-				s.push_back('_');
+			auto const range = r - numRangesA;
+			auto const end = std::min(b.header.numStars, (range + 1)*DIFF_RANGE);
+			for (auto j = range*DIFF_RANGE; j < end; ++j) {
+				if (options.byIndex ? j < a.header.numStars :
+				    idsA.find(b.table.starId[j]) != idsA.end()) {
+					continue;
+				}
+				out.append("+ ");
+				appendKey(&out, b, j, options.byIndex);
+				out.append("\n");
+				++numAdded;
 			}
 		}
+	};
+	{
+		PhaseTimer timer(PHASE_FILTER, 0, a.header.numStars + b.header.numStars);
+		pool.parallelFor(numRangesA + numRangesB, work);
 	}
-	return s;
+
+	PhaseTimer timer(PHASE_OUTPUT);
+	for (auto const& report : reports) {
+		std::fwrite(report.data(), 1, report.size(), stdout);
+	}
+	std::fprintf(stdout, "Removed: %zu, added: %zu, changed: %zu, unchanged: %zu\n",
+		     numRemoved.load(), numAdded.load(), numChanged.load(),
+		     (size_t)a.header.numStars - numRemoved - numChanged);
+	return 0;
 }
 
+}	// !namespace
+
+/*
+ * Global allocation functions, replaced to count allocations for
+ * --profile.  Every form is replaced, so that whichever one a new
+ * expression picks is paired with a matching delete.
+ */
 static
+void*
+allocateCounted(std::size_t const size)
+{
+	countAllocation();
+	if (auto p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void*
+operator new(std::size_t size)
+{
+	return allocateCounted(size);
+}
+
+void*
+operator new[](std::size_t size)
+{
+	return allocateCounted(size);
+}
+
 void
-printCHeader(char const* const inputfile,
-	     unsigned const numStars,
-	     Epoch const epoch,
-	     bool const usefloat,
-	     bool const usename,
-	     bool const usetype)
+operator delete(void* p) noexcept
 {
-	auto const var = sanitizeForC(inputfile);
+	std::free(p);
+}
 
-	std::fprintf(stdout,
-		     "/*\n"
-		     " * Auto-generated from catalog %s by the sidus program\n"
-		     " *\n"
-		     " * Do this:\n"
-		     " *   #define SIDUS_IMPLEMENTATION\n"
-		     " * before you include this file in *one* C or C++ file to create the implementation\n"
-		     " *\n"
-		     " */\n\n",
-		     inputfile);
-	std::fprintf(stdout,
-		     "#ifndef %s_h\n"
-		     "#define %s_h\n\n",
-		     var.c_str(), var.c_str());
-	std::fputs("#ifdef __cplusplus\n"
-		   "extern \"C\" {\n"
-		   "#endif\n\n",
-		   stdout);
-
-	std::fputs("struct Star {\n", stdout);
-	auto const epochstr = epoch == Epoch::J2000 ? "J2000" : "B1950";
-	if (usefloat) {
-		std::fprintf(stdout,
-			     "	float rightAscension;	/* radians, %s */\n"
-			     "	float declination;	/* radians, %s */\n"
-			     "	float magnitude;\n",
-			     epochstr, epochstr);
-	} else {
-		std::fprintf(stdout,
-			     "	double rightAscension;	/* radians, %s */\n"
-			     "	double declination;	/* radians, %s */\n"
-			     "	double magnitude;\n",
-			     epochstr, epochstr);
-	}
-	if (usename) {
-		std::fputs("	const char *name;\n", stdout);
-	}
-	if (usetype) {
-		std::fputs("	const char *type;\n", stdout);
-	}
-	std::fprintf(stdout, 
-		     "};\n\n"
-		     "enum { %s_num_stars = %u };\n\n"
-		     "#ifndef SIDUS_IMPLEMENTATION\n"
-		     "extern const struct Star * %s_stars;\n"
-		     "#else\n"
-		     "const struct Star %s_stars[%u] = {",
-		     var.c_str(), numStars,
-		     var.c_str(),
-		     var.c_str(), numStars);
+void
+operator delete[](void* p) noexcept
+{
+	std::free(p);
 }
 
-static
 void
-printCFooter()
+operator delete(void* p, std::size_t) noexcept
 {
-	std::fputs("\n};\n\n"
-		   "#endif\n\n"
-		   "#ifdef __cplusplus\n"
-		   "}\n"
-		   "#endif\n\n"
-		   "#endif\n",
-		   stdout);
+	std::free(p);
 }
 
-static
 void
-print(
-    Star const& star,
-    Header const & header,
-    int const idx,
-    bool const cformat,
-    bool const usefloat,
-    bool const usename,
-    bool const usetype)
+operator delete[](void* p, std::size_t) noexcept
 {
-	if (cformat) {
-		if (idx != 0) {
-			std::fputs(", ", stdout);
-		}
-		if (usefloat) {
-			std::fprintf(stdout,
-				     "\n	{ % .9f, % .9f, % .9f",
-				     star.rightAscension,
-				     star.declination,
-				     star.magnitude);
-		} else {
-			std::fprintf(stdout,
-				     "\n	{ % .17lf, % .17lf, % .17lf",
-				     star.rightAscension,
-				     star.declination,
-				     star.magnitude);
-		}
-		if (usename) {
-			std::fprintf(stdout,
-				     ", \"%s\"",
-				     star.name.c_str());
-		}
-		if (usetype) {
-			std::fprintf(stdout,
-				     ", \"%s\"",
-				     star.spectralType);
-		}
-		std::fputs(" }", stdout);
-	} else {
-		if (usename) {
-			std::fprintf(stdout, "%s,", star.name.c_str());
-		}
-		if (usefloat) {
-			std::fprintf(stdout,
-				     "%.9f,%.9f,%.9f",
-				     star.rightAscension,
-				     star.declination,
-				     star.magnitude);
-		} else {
-			std::fprintf(stdout,
-				     "%.17lf,%.17lf,%.17lf",
-				     star.rightAscension,
-				     star.declination,
-				     star.magnitude);
-		}
-		if (usetype) {
-			std::fprintf(stdout,
-				     ",%c%c",
-				     star.spectralType[0],
-				     star.spectralType[1]);
-		}
-		std::fputc('\n', stdout);
+	std::free(p);
+}
+
+#if defined(__cpp_aligned_new)
+static
+void*
+allocateCounted(std::size_t const size, std::align_val_t const alignment)
+{
+	countAllocation();
+	auto const align = std::max(sizeof(void*), (std::size_t)alignment);
+	void* p;
+	if (posix_memalign(&p, align, size ? size : 1) == 0) {
+		return p;
 	}
+	throw std::bad_alloc();
 }
 
-}	// !namespace
+void*
+operator new(std::size_t size, std::align_val_t alignment)
+{
+	return allocateCounted(size, alignment);
+}
+
+void*
+operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return allocateCounted(size, alignment);
+}
+
+void
+operator delete(void* p, std::align_val_t) noexcept
+{
+	std::free(p);
+}
+
+void
+operator delete[](void* p, std::align_val_t) noexcept
+{
+	std::free(p);
+}
 
+void
+operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+	std::free(p);
+}
+
+void
+operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+	std::free(p);
+}
+#endif
+
+/*
+ * The benchmarks include this file with SIDUS_NO_MAIN defined.
+ */
+#if !defined(SIDUS_NO_MAIN)
 int
 main(int argc, char** argv)
 {
+	profile.start = std::chrono::steady_clock::now();
+
 	if (argc < 1) {
 		usage(stderr);
 		return -1;
 	}
 
-	auto apparentMagnitude = 0;
-	auto filterMagnitude = DBL_MAX;
+	auto apparentMagnitude = -1;
 	Epoch epoch = Epoch::AUTO;
-	auto cformat = false;
 	Endian endian = Endian::AUTO;
-	auto usefloat = false;
 	auto onlymeta = false;
-	enum class Sort { NO, MAG, RA } sort = Sort::NO;
-	auto usename = false;
-	auto usetype = false;
+	auto onlystats = false;
+	char const* socketPath = nullptr;
+	char const* watchfile = nullptr;
+	char const* difffile = nullptr;
+	DiffOptions diffOptions;
+	diffOptions.byIndex = false;
+	std::fill(diffOptions.tolerance, diffOptions.tolerance + NUM_DIFF_FIELDS, 0.0);
 	char const* inputfile = nullptr;
+	Options options;
+	options.filterMagnitude = DBL_MAX;
+	options.spectralFilter = false;
+	std::memset(options.spectralClasses, 0, sizeof options.spectralClasses);
+	options.format.cformat = false;
+	options.format.usefloat = false;
+	options.format.usename = false;
+	options.format.usetype = false;
+	options.format.cull = false;
+	options.format.lod = false;
+	options.lod = 0;
+	options.tiles = nullptr;
+	parseTileLimits(&options.tileLimits, "6,8,10,12");
+	options.numThreads = std::max(1u, std::thread::hardware_concurrency());
+	options.numa = false;
+	options.maxMemory = 0;
+	options.shard = 0;
+	options.numShards = 0;
+	auto mergeshards = false;
+	std::vector<char const*> inputs;
 
 	for (auto i = 1; i < argc; ++i) {
 		auto const arg = std::string(argv[i]);
@@ -602,7 +6343,12 @@ main(int argc, char** argv)
 					usage(stderr);
 					return -1;
 				}
-				apparentMagnitude = std::stod(arg.substr(2));
+				if (arg.size() != 3 || !std::isdigit((unsigned char)arg[2])) {
+					std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+					usage(stderr);
+					return -1;
+				}
+				apparentMagnitude = arg[2] - '0';
 				continue;
 			case 'f':
 				if (arg.size() < 3) {
@@ -610,7 +6356,7 @@ main(int argc, char** argv)
 					usage(stderr);
 					return -1;
 				}
-				filterMagnitude = std::stod(arg.substr(2));
+				options.filterMagnitude = std::stod(arg.substr(2));
 				continue;
 			case 'B':
 				if (arg.size() < 3 || arg.substr(2) != "1950") {
@@ -629,7 +6375,7 @@ main(int argc, char** argv)
 				epoch = Epoch::J2000;
 				continue;
 			case 'c':
-				cformat = true;
+				options.format.cformat = true;
 				break;
 			case 'l':
 				if (arg.size() < 3 || arg[2] != 'e') {
@@ -648,22 +6394,22 @@ main(int argc, char** argv)
 				endian = Endian::BIG;
 				continue;
 			case 's':
-				usefloat = true;
+				options.format.usefloat = true;
 				break;
 			case 'i':
 				onlymeta = true;
 				break;
 			case 'm':
-				sort = Sort::MAG;
+				options.sort.assign(1, SortKey{ SortField::MAG, false });
 				break;
 			case 'r':
-				sort = Sort::RA;
+				options.sort.assign(1, SortKey{ SortField::RA, false });
 				break;
 			case 'n':
-				usename = true;
+				options.format.usename = true;
 				break;
 			case 'p':
-				usetype = true;
+				options.format.usetype = true;
 				break;
 			case 'h':
 				usage(stdout);
@@ -682,6 +6428,170 @@ main(int argc, char** argv)
 						version();
 						return 0;
 
+					}
+					else if (larg == "bands") {
+						if (i + 1 >= argc || parseBands(&options.format.bands, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "colors") {
+						if (i + 1 >= argc || parseColors(&options.format.colors, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "filter") {
+						if (i + 1 >= argc) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						options.filterText = argv[++i];
+					}
+					else if (larg == "spectral") {
+						if (i + 1 >= argc || !*argv[i + 1]) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						for (auto c = argv[++i]; *c; ++c) {
+							for (auto const v : { std::toupper((unsigned char)*c),
+									      std::tolower((unsigned char)*c) }) {
+								options.spectralClasses[v/64] |= (std::uint64_t)1 << (v%64);
+							}
+						}
+						options.spectralFilter = true;
+					}
+					else if (larg == "profile" || larg == "profile=json") {
+						profile.enabled = true;
+						profile.json = larg == "profile=json";
+					}
+					else if (larg == "counters") {
+						profile.enabled = true;
+						profile.counters = true;
+					}
+					else if (larg == "numa") {
+						options.numa = true;
+					}
+					else if (larg == "huge-pages") {
+						hugePages = true;
+					}
+					else if (larg == "lod") {
+						if (i + 1 >= argc || std::atoi(argv[i + 1]) < 1) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						options.lod = std::atoi(argv[++i]);
+						options.format.lod = true;
+					}
+					else if (larg == "tiles") {
+						if (i + 1 >= argc || !*argv[i + 1]) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						options.tiles = argv[++i];
+					}
+					else if (larg == "tile-limits") {
+						if (i + 1 >= argc || parseTileLimits(&options.tileLimits, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "cull") {
+						options.format.cull = true;
+					}
+					else if (larg == "stats") {
+						onlystats = true;
+					}
+					else if (larg == "serve") {
+						if (i + 1 >= argc || !*argv[i + 1]) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						socketPath = argv[++i];
+					}
+					else if (larg == "diff") {
+						if (i + 1 >= argc || !*argv[i + 1]) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						difffile = argv[++i];
+					}
+					else if (larg == "diff-by") {
+						if (i + 1 >= argc ||
+						    (std::strcmp(argv[i + 1], "id") != 0 && std::strcmp(argv[i + 1], "index") != 0)) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						diffOptions.byIndex = std::strcmp(argv[++i], "index") == 0;
+					}
+					else if (larg == "tolerance") {
+						if (i + 1 >= argc || parseTolerances(diffOptions.tolerance, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "watch") {
+						if (i + 1 >= argc || !*argv[i + 1]) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						watchfile = argv[++i];
+					}
+					else if (larg == "sort") {
+						if (i + 1 >= argc || parseSortKeys(&options.sort, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "shard") {
+						char* rest = nullptr;
+						auto const shard = i + 1 < argc ? std::strtol(argv[i + 1], &rest, 10) : 0;
+						auto const numShards = rest && *rest == '/' ? std::strtol(rest + 1, &rest, 10) : 0;
+						if (!rest || *rest || shard < 1 || shard > numShards || numShards > 1 << 16) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						options.shard = (int)shard;
+						options.numShards = (int)numShards;
+						++i;
+					}
+					else if (larg == "merge-shards") {
+						mergeshards = true;
+					}
+					else if (larg == "max-memory") {
+						if (i + 1 >= argc || parseSize(&options.maxMemory, argv[i + 1]) != 0) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						++i;
+					}
+					else if (larg == "threads") {
+						if (i + 1 >= argc || std::atoi(argv[i + 1]) < 1) {
+							std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+							usage(stderr);
+							return -1;
+						}
+						options.numThreads = std::atoi(argv[++i]);
 					} else {
 						usage(stderr);
 						return -1;
@@ -699,7 +6609,50 @@ main(int argc, char** argv)
 			}
 		} else {
 			inputfile = argv[i];
+			inputs.push_back(argv[i]);
+		}
+	}
+
+	if (compileFilter(&options.filter, options.filterText, options.filterMagnitude) != 0) {
+		return -1;
+	}
+	pool.start(options.numThreads, options.numa);
+	if (options.format.cull) {
+		if (!options.format.cformat) {
+			std::fprintf(stderr, "sidus: --cull needs -c\n");
+			return -1;
+		}
+		if (options.lod > 0) {
+			std::fprintf(stderr, "sidus: --cull and --lod cannot be combined\n");
+			return -1;
+		}
+		options.sort.clear();
+		options.sort.push_back(SortKey{ SortField::CELL, false });
+		options.sort.push_back(SortKey{ SortField::MAG, false });
+	}
+	if (options.tiles && (options.lod > 0 || options.format.cull)) {
+		std::fprintf(stderr, "sidus: --tiles cannot be combined with --lod or --cull\n");
+		return -1;
+	}
+	if (options.lod > 0 || options.tiles) {
+		options.sort.assign(1, SortKey{ SortField::MAG, false });
+	}
+	if (options.maxMemory != 0 && (options.lod > 0 || options.format.cull || watchfile)) {
+		std::fprintf(stderr, "sidus: --max-memory cannot be combined with --lod, --cull or --watch\n");
+		return -1;
+	}
+	if ((options.numShards != 0 || mergeshards) &&
+	    (options.lod > 0 || options.format.cull || options.tiles || watchfile)) {
+		std::fprintf(stderr, "sidus: --shard and --merge-shards cannot be combined with --lod, --cull, --tiles or --watch\n");
+		return -1;
+	}
+	if (mergeshards) {
+		if (inputs.empty() || options.numShards != 0) {
+			std::fprintf(stderr, "sidus: --merge-shards needs shard files, and no --shard\n");
+			usage(stderr);
+			return -1;
 		}
+		return mergeShards(inputs, &options);
 	}
 
 	if (!inputfile) {
@@ -725,21 +6678,30 @@ main(int argc, char** argv)
 	}
 
 
-	auto data = std::unique_ptr<unsigned char[]>(new unsigned char[filesize]);
-	if (readFile(data.get(), inputfile, filesize) != 0) {
-		std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+	FILE* f = fopen(inputfile, "rb");
+	if (!f) {
+		std::fprintf(stderr, "sidus: %s: failed to open file\n", inputfile);
 		return -1;
 	}
+	std::unique_ptr<FILE, int (*)(FILE*)> file(f, fclose);
 
 	Header header;
-	if (parseHeader(&header, data.get(), epoch, endian) != 0) {
-		return -1;
+	{
+		PhaseTimer timer(PHASE_HEADER, 28);
+		unsigned char raw[28];
+		if (readFully(f, raw, sizeof raw) != 0) {
+			std::fprintf(stderr, "sidus: %s: failed to read file\n", inputfile);
+			return -1;
+		}
+		if (parseHeader(&header, raw, epoch, endian) != 0) {
+			return -1;
+		}
 	}
 
-	auto const starDataSize = header.numStars*header.numBytesPerStar;
+	auto const starDataSize = (size_t)header.numStars*header.numBytesPerStar;
 
 	if (filesize < (28 + starDataSize)) {
-		std::fprintf(stderr, "sidus: header.numStars: %d, bytesPerStar: %d, %lu < %d, file too short\n",
+		std::fprintf(stderr, "sidus: header.numStars: %d, bytesPerStar: %d, %zu < %zu, file too short\n",
 			     header.numStars, header.numBytesPerStar, filesize, 28 + starDataSize);
 		return -1;
 	}
@@ -748,9 +6710,23 @@ main(int argc, char** argv)
 			     header.numMagnitudes);
 		return -1;
 	}
-	header.apparentMagnitude = std::min(header.numMagnitudes - 1, header.numMagnitudes);
+	// Without -a the last magnitude is used, as it always has been.
+	header.apparentMagnitude = apparentMagnitude < 0 ?
+	    header.numMagnitudes - 1 : apparentMagnitude;
+	auto bands = options.filter.bands | (1u << header.apparentMagnitude);
+	for (auto const band : options.format.bands) {
+		bands |= 1u << band;
+	}
+	for (auto const& color : options.format.colors) {
+		bands |= (1u << color.first) | (1u << color.second);
+	}
+	if (bands >> header.numMagnitudes) {
+		std::fprintf(stderr, "sidus: magnitude band out of range, catalog has %d\n",
+			     header.numMagnitudes);
+		return -1;
+	}
 	if (header.starNameLength == 0) {
-		usename = false;
+		options.format.usename = false;
 	}
 
 	if (onlymeta) {
@@ -782,46 +6758,34 @@ main(int argc, char** argv)
 		return 0;
 	}
 
-	auto cursor = 28;
-	std::multimap<double, Star> map;
-	for (auto i = 0; i < header.numStars; ++i, cursor += header.numBytesPerStar) {
-		Star star;
-		if (parseStar(&star, header, data.get() + cursor) != 0) {
-			continue;
-		}
-		if (star.magnitude > filterMagnitude) {
-			continue;
-		}
-		// Filter out "invalid" entries
-		if (star.magnitude == 0.0 &&
-		    star.rightAscension == 0.0 &&
-		    star.declination == 0.0) {
-			continue;
-		}
-
-		switch (sort) {
-		case Sort::RA:
-			map.insert(std::make_pair(star.rightAscension, star));
-			break;
-		case Sort::MAG:
-			map.insert(std::make_pair(star.magnitude, star));
-			break;
-		default:
-			map.insert(std::make_pair(i, star));
-			break;
-		}
+	if (header.numBytesPerStar < recordLayout(header).size) {
+		std::fprintf(stderr, "sidus: bytesPerStar: %d, expected at least %d\n",
+			     header.numBytesPerStar, recordLayout(header).size);
+		return -1;
 	}
 
-	if (cformat) {
-		printCHeader(inputfile, map.size(), header.epoch, usefloat, usename, usetype);
+	if (socketPath) {
+		return serve(socketPath, inputfile, filesize, header, options);
 	}
-
-	auto idx = 0;
-	for (auto const & pair : map) {
-		print(pair.second, header, idx++, cformat, usefloat, usename, usetype);
+	if (watchfile) {
+		return watch(watchfile, inputfile, header, options);
+	}
+	if (difffile) {
+		auto const rv = diff(difffile, inputfile, header, diffOptions);
+		if (profile.enabled) {
+			std::fflush(stdout);
+			printProfile(stderr);
+		}
+		return rv;
 	}
 
-	if (cformat) {
-		printCFooter();
+	auto const rv = onlystats ?
+	    computeStats(f, inputfile, header, options) :
+	    convert(f, inputfile, header, options);
+	if (profile.enabled) {
+		std::fflush(stdout);
+		printProfile(stderr);
 	}
+	return rv;
 }
+#endif
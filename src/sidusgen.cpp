@@ -0,0 +1,526 @@
+/**
+ * sidusgen - a generator of synthetic Yale Bright Star type catalogs
+ *
+ * Copyright (c) 2019 Jon Olsson <jlo@wintermute.net>
+ *
+ * cf. http://tdc-www.harvard.edu/catalogs/catalogsb.html
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+namespace {
+
+/*
+ * Stars are generated in blocks, each from its own random sequence
+ * seeded by the block number, so the output only depends on the seed and
+ * never on the number of threads.
+ */
+static int const BLOCK_STARS = 1 << 16;
+
+struct Params {
+	std::int64_t numStars;
+	int starId;		// STNUM, 0-4
+	int starNameLength;	// written as a negative STNUM when non-zero
+	int properMotion;	// MPROP, 0-2
+	int numMagnitudes;
+	bool littleEndian;
+	bool j2000;
+	std::uint64_t seed;
+	double faintest;
+	int numThreads;
+};
+
+class Random {
+public:
+	explicit Random(std::uint64_t seed)
+	{
+		// splitmix64 to spread nearby seeds apart
+		for (auto& s : state) {
+			seed += 0x9e3779b97f4a7c15ull;
+			auto z = seed;
+			z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+			s = z ^ (z >> 31);
+		}
+	}
+
+	// xoshiro256**
+	std::uint64_t
+	next()
+	{
+		auto const result = rotl(state[1]*5, 7)*9;
+		auto const t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotl(state[3], 45);
+		return result;
+	}
+
+	double
+	uniform()
+	{
+		return (next() >> 11)*(1.0/9007199254740992.0);
+	}
+
+	double
+	uniform(double const min, double const max)
+	{
+		return min + (max - min)*uniform();
+	}
+
+	double
+	normal()
+	{
+		auto const u = std::max(uniform(), 1e-300);
+		return std::sqrt(-2.0*std::log(u))*std::cos(2.0*M_PI*uniform());
+	}
+
+private:
+	std::uint64_t state[4];
+
+	static
+	std::uint64_t
+	rotl(std::uint64_t const x, int const k)
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+};
+
+static
+void
+usage(FILE * f)
+{
+	std::fprintf(f, "Usage: sidusgen [option(s)] <output-file>\n");
+	std::fprintf(f, "Options:\n");
+	std::fprintf(f, " -n<count>	number of stars (default 9110)\n");
+	std::fprintf(f, " -d<0-4>		star id: none, catalog, GSC, Tycho, integer (default 1)\n");
+	std::fprintf(f, " -N<length>	star names of the given length, instead of an id\n");
+	std::fprintf(f, " -p<0-2>		proper motion: none, proper motion, radial velocity\n");
+	std::fprintf(f, "		(default 1)\n");
+	std::fprintf(f, " -k<1-10>	number of magnitudes (default 1)\n");
+	std::fprintf(f, " -f<magnitude>	faintest magnitude (default depends on count)\n");
+	std::fprintf(f, " -s<seed>	random seed (default 1)\n");
+	std::fprintf(f, " -B1950		write B1950 epoch\n");
+	std::fprintf(f, " -J2000		write J2000 epoch (default)\n");
+	std::fprintf(f, " -le		write little-endian format (default)\n");
+	std::fprintf(f, " -be		write big-endian format\n");
+	std::fprintf(f, " --threads <n>	number of generating threads\n");
+	std::fprintf(f, " -h | --help	show this help information\n");
+	std::fprintf(f, " -v | --version	show version information\n");
+}
+
+static
+void
+version()
+{
+	std::fprintf(stdout, "sidusgen v0.1 by Jon Olsson <jlo@wintermute.net>\n");
+}
+
+static
+void
+put(unsigned char* data, std::uint64_t const value, int const size, bool const littleEndian)
+{
+	for (auto i = 0; i < size; ++i) {
+		data[littleEndian ? i : size - 1 - i] = (unsigned char)(value >> (8*i));
+	}
+}
+
+static
+void
+put(unsigned char* data, float const value, bool const littleEndian)
+{
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	put(data, bits, 4, littleEndian);
+}
+
+static
+void
+put(unsigned char* data, double const value, bool const littleEndian)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof bits);
+	put(data, bits, 8, littleEndian);
+}
+
+static
+int
+recordSize(Params const& params)
+{
+	auto size = 8 + 8 + 2 + 2*params.numMagnitudes + params.starNameLength;
+	if (params.starNameLength == 0 && params.starId != 0) {
+		size += 4;
+	}
+	if (params.properMotion == 1) {
+		size += 4 + 4;
+	}
+	else if (params.properMotion == 2) {
+		size += 8;
+	}
+	return size;
+}
+
+static
+void
+writeHeader(unsigned char* data, Params const& params)
+{
+	auto const le = params.littleEndian;
+	auto const starn = params.j2000 ? -params.numStars : params.numStars;
+	auto const stnum = params.starNameLength ? -params.starNameLength : params.starId;
+	auto const nmag = params.j2000 ? -params.numMagnitudes : params.numMagnitudes;
+	put(data + 0, (std::uint64_t)0, 4, le);		// STAR0
+	put(data + 4, (std::uint64_t)1, 4, le);		// STAR1
+	put(data + 8, (std::uint64_t)starn, 4, le);
+	put(data + 12, (std::uint64_t)stnum, 4, le);
+	put(data + 16, (std::uint64_t)params.properMotion, 4, le);
+	put(data + 20, (std::uint64_t)nmag, 4, le);
+	put(data + 24, (std::uint64_t)recordSize(params), 4, le);
+}
+
+/*
+ * Counts of stars brighter than m grow roughly as 10^(0.47 m) over the
+ * range of interest, with about 9110 brighter than 6.5 as in the BSC5,
+ * so magnitudes are drawn from that exponential between -1.5 and the
+ * faintest magnitude.
+ */
+static double const MAGNITUDE_SLOPE = 0.47;
+static double const BRIGHTEST = -1.5;
+
+static
+double
+defaultFaintest(std::int64_t const numStars)
+{
+	return 6.5 + std::log10(std::max((double)numStars, 1.0)/9110.0)/MAGNITUDE_SLOPE;
+}
+
+static
+double
+magnitude(Random* random, double const faintest)
+{
+	auto const k = MAGNITUDE_SLOPE*std::log(10.0);
+	auto const lo = std::exp(k*(BRIGHTEST - faintest));
+	return faintest + std::log(lo + (1.0 - lo)*random->uniform())/k;
+}
+
+/*
+ * Fainter stars crowd towards the galactic plane: with a probability
+ * rising with magnitude the galactic latitude is drawn from a Laplace
+ * distribution rather than uniformly over the sphere.  The result is
+ * rotated from galactic to equatorial J2000 coordinates.
+ */
+static
+void
+position(Random* random, double const mag, double* ra, double* dec)
+{
+	auto const l = random->uniform(0.0, 2.0*M_PI);
+	double b;
+	auto const disk = std::min(0.8, std::max(0.1, 0.1 + 0.05*mag));
+	if (random->uniform() < disk) {
+		// Latitudes past the poles are drawn again rather than clamped,
+		// which would pile them onto the poles; u stays inside
+		// (-0.5, 0.5) so the logarithm is finite.
+		auto const scale = 12.0*M_PI/180.0;
+		do {
+			double u;
+			do {
+				u = random->uniform(-0.5, 0.5);
+			} while (u <= -0.5);
+			b = -scale*(u < 0.0 ? -1.0 : 1.0)*std::log(1.0 - 2.0*std::fabs(u));
+		} while (std::fabs(b) > M_PI/2);
+	} else {
+		b = std::asin(random->uniform(-1.0, 1.0));
+	}
+
+	double const g[3] = { std::cos(b)*std::cos(l), std::cos(b)*std::sin(l), std::sin(b) };
+	// Transpose of the equatorial to galactic rotation
+	static double const m[3][3] = {
+		{ -0.0548755604, +0.4941094279, -0.8676661490 },
+		{ -0.8734370902, -0.4448296300, -0.1980763734 },
+		{ -0.4838350155, +0.7469822445, +0.4559837762 }
+	};
+	double e[3];
+	for (auto i = 0; i < 3; ++i) {
+		e[i] = m[i][0]*g[0] + m[i][1]*g[1] + m[i][2]*g[2];
+	}
+	*ra = std::atan2(e[1], e[0]);
+	if (*ra < 0.0) {
+		*ra += 2.0*M_PI;
+	}
+	*dec = std::asin(std::max(-1.0, std::min(1.0, e[2])));
+}
+
+/*
+ * Spectral classes of naked eye stars, roughly.
+ */
+static
+char
+spectralClass(Random* random)
+{
+	static char const classes[] = "OBAFGKM";
+	static double const fractions[] = { 0.002, 0.18, 0.22, 0.14, 0.12, 0.30, 0.038 };
+	auto u = random->uniform();
+	for (auto i = 0; i < 7; ++i) {
+		if (u < fractions[i]) {
+			return classes[i];
+		}
+		u -= fractions[i];
+	}
+	return 'K';
+}
+
+static
+void
+generateBlock(unsigned char* data, std::int64_t const first, int const count, Params const& params)
+{
+	auto const le = params.littleEndian;
+	auto const size = recordSize(params);
+	Random random(params.seed*0x100000001b3ull + (std::uint64_t)first/BLOCK_STARS);
+	for (auto i = 0; i < count; ++i) {
+		auto const record = data + (size_t)i*size;
+		auto cursor = 0;
+		auto const index = first + i;
+		if (params.starNameLength == 0 && params.starId != 0) {
+			if (params.starId == 4) {
+				put(record + cursor, (std::uint64_t)(index + 1), 4, le);
+			} else {
+				put(record + cursor, (float)(index + 1), le);
+			}
+			cursor += 4;
+		}
+
+		auto const mag = magnitude(&random, params.faintest);
+		double ra, dec;
+		position(&random, mag, &ra, &dec);
+		put(record + cursor, ra, le);
+		cursor += 8;
+		put(record + cursor, dec, le);
+		cursor += 8;
+
+		record[cursor++] = spectralClass(&random);
+		record[cursor++] = '0' + random.next()%10;
+
+		// Further bands scatter around the first one, as colors do.
+		for (auto m = 0; m < params.numMagnitudes; ++m) {
+			auto const value = m == 0 ? mag : mag + 0.4*random.normal();
+			auto const hundredths = std::max(-32768.0, std::min(32767.0, std::floor(value*100.0 + 0.5)));
+			put(record + cursor, (std::uint64_t)(std::int64_t)hundredths, 2, le);
+			cursor += 2;
+		}
+
+		if (params.properMotion == 1) {
+			// Nearby, brighter stars tend to move faster, ~0.1"/yr
+			auto const scale = 0.1/206264.806*std::pow(10.0, -0.1*mag);
+			put(record + cursor, (float)(scale*random.normal()), le);
+			cursor += 4;
+			put(record + cursor, (float)(scale*random.normal()), le);
+			cursor += 4;
+		}
+		else if (params.properMotion == 2) {
+			put(record + cursor, 25.0*random.normal(), le);
+			cursor += 8;
+		}
+
+		if (params.starNameLength > 0) {
+			char name[32];
+			auto const n = std::snprintf(name, sizeof name, "S%lld", (long long)(index + 1));
+			for (auto c = 0; c < params.starNameLength; ++c) {
+				record[cursor + c] = c < n ? name[c] : ' ';
+			}
+			cursor += params.starNameLength;
+		}
+	}
+}
+
+static
+int
+generate(FILE* f, Params const& params)
+{
+	unsigned char header[28];
+	writeHeader(header, params);
+	if (std::fwrite(header, 1, sizeof header, f) != sizeof header) {
+		return -1;
+	}
+
+	// Each round generates one block per thread, then writes them in order.
+	auto const size = (size_t)recordSize(params);
+	auto const numThreads = std::max(1, params.numThreads);
+	std::vector<std::vector<unsigned char>> blocks(numThreads);
+	for (std::int64_t first = 0; first < params.numStars; first += (std::int64_t)numThreads*BLOCK_STARS) {
+		std::vector<std::thread> threads;
+		std::vector<int> counts(numThreads, 0);
+		for (auto t = 0; t < numThreads; ++t) {
+			auto const start = first + (std::int64_t)t*BLOCK_STARS;
+			if (start >= params.numStars) {
+				break;
+			}
+			counts[t] = (int)std::min((std::int64_t)BLOCK_STARS, params.numStars - start);
+			blocks[t].resize(counts[t]*size);
+			threads.emplace_back(generateBlock, blocks[t].data(), start, counts[t], std::cref(params));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		for (auto t = 0; t < numThreads && counts[t] > 0; ++t) {
+			if (std::fwrite(blocks[t].data(), 1, counts[t]*size, f) != counts[t]*size) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+}	// !namespace
+
+int
+main(int argc, char** argv)
+{
+	Params params;
+	params.numStars = 9110;
+	params.starId = 1;
+	params.starNameLength = 0;
+	params.properMotion = 1;
+	params.numMagnitudes = 1;
+	params.littleEndian = true;
+	params.j2000 = true;
+	params.seed = 1;
+	params.faintest = NAN;
+	params.numThreads = std::max(1u, std::thread::hardware_concurrency());
+	char const* outputfile = nullptr;
+
+	for (auto i = 1; i < argc; ++i) {
+		auto const arg = std::string(argv[i]);
+		if (arg[0] != '-') {
+			outputfile = argv[i];
+			continue;
+		}
+		if (arg.size() < 2) {
+			usage(stderr);
+			return -1;
+		}
+		auto const value = arg.substr(2);
+		auto valid = true;
+		switch (arg[1]) {
+		case 'n':
+			params.numStars = std::atoll(value.c_str());
+			valid = params.numStars > 0 && params.numStars <= 0x7fffffff;
+			break;
+		case 'd':
+			params.starId = std::atoi(value.c_str());
+			valid = value.size() == 1 && params.starId >= 0 && params.starId <= 4;
+			break;
+		case 'N':
+			params.starNameLength = std::atoi(value.c_str());
+			valid = params.starNameLength > 0 && params.starNameLength <= 32;
+			break;
+		case 'p':
+			params.properMotion = std::atoi(value.c_str());
+			valid = value.size() == 1 && params.properMotion >= 0 && params.properMotion <= 2;
+			break;
+		case 'k':
+			params.numMagnitudes = std::atoi(value.c_str());
+			valid = params.numMagnitudes >= 1 && params.numMagnitudes <= 10;
+			break;
+		case 'f':
+			params.faintest = std::atof(value.c_str());
+			valid = !value.empty() && params.faintest > BRIGHTEST;
+			break;
+		case 's':
+			params.seed = std::strtoull(value.c_str(), nullptr, 10);
+			valid = !value.empty();
+			break;
+		case 'B':
+			params.j2000 = false;
+			valid = value == "1950";
+			break;
+		case 'J':
+			params.j2000 = true;
+			valid = value == "2000";
+			break;
+		case 'l':
+			params.littleEndian = true;
+			valid = value == "e";
+			break;
+		case 'b':
+			params.littleEndian = false;
+			valid = value == "e";
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 'v':
+			version();
+			return 0;
+		case '-':
+			if (value == "help") {
+				usage(stdout);
+				return 0;
+			}
+			else if (value == "version") {
+				version();
+				return 0;
+			}
+			else if (value == "threads" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+				params.numThreads = std::atoi(argv[++i]);
+			} else {
+				valid = false;
+			}
+			break;
+		default:
+			valid = false;
+			break;
+		}
+		if (!valid) {
+			std::fprintf(stderr, "Invalid option '%s'\n", arg.c_str());
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (!outputfile) {
+		std::fprintf(stderr, "sidusgen: no output file\n");
+		usage(stderr);
+		return -1;
+	}
+	if (std::isnan(params.faintest)) {
+		params.faintest = defaultFaintest(params.numStars);
+	}
+
+	FILE* f = std::fopen(outputfile, "wb");
+	if (!f) {
+		std::fprintf(stderr, "sidusgen: %s: failed to open file\n", outputfile);
+		return -1;
+	}
+	auto rv = generate(f, params);
+	if (std::fclose(f) != 0) {
+		rv = -1;
+	}
+	if (rv != 0) {
+		std::fprintf(stderr, "sidusgen: %s: failed to write file\n", outputfile);
+		return -1;
+	}
+	return 0;
+}